@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <time.h>
 #include <pthread.h>
+#include <string.h>
+#include <unistd.h>
 
 #define ENABLE_GREEN		1
 #define ENABLE_PTHREAD		1
@@ -12,9 +14,13 @@
 #define ENABLE_ORDERED		0
 #define ENABLE_SYNCHRONIZED	1
 
+#define WORKER_COUNT	0	// green worker OS threads, 0 uses one per online core
 #define THREAD_COUNT	8
 #define CYCLE_COUNT		1000000
 
+#define MUTEX_MODES		3	// green_mutex_mode values the synchronized case runs with
+#define SCHED_POLICIES	3	// green_sched_policy values, picked by the first argument
+
 #define TU_PER_SEC		1000
 #define NANOS_PER_TU	(1000000000 / TU_PER_SEC)
 
@@ -23,6 +29,8 @@ static int shared_counter;
 static int flag;
 
 static char const * const TIME_UNIT = "ms";
+static char const * const MODE_NAMES[MUTEX_MODES] = {"barging", "handoff", "adaptive"};
+static char const * const POLICY_NAMES[SCHED_POLICIES] = {"fifo", "lifo", "random"};
 
 static inline double get_time_since(struct timespec *time) {
 	struct timespec now;
@@ -62,17 +70,32 @@ void *ordered(void *arg);
 /// Some task that performs a workload that needs to be synchronized with others to work as expected
 void *synchronized(void *arg);
 
-int main() {
+int main(int argc, char **argv) {
 	green_t				gthreads[THREAD_COUNT];
 	pthread_t			pthreads[THREAD_COUNT];
 	struct thread_args	args[THREAD_COUNT];
 	
 	synchronization sync = {0};
 	double greens[3], pts[3];
+	double modes[MUTEX_MODES], switch_rates[MUTEX_MODES];	// synchronized per mutex mode
 	
 	sync.library = Green;
 	struct timespec start_time;
 	
+	int workers = WORKER_COUNT ? WORKER_COUNT : sysconf(_SC_NPROCESSORS_ONLN);
+	green_set_concurrency(workers);
+	
+	int policy = GREEN_SCHED_FIFO;
+	if (argc > 1) {
+		for (policy = 0; policy < SCHED_POLICIES && strcmp(argv[1], POLICY_NAMES[policy]) != 0; ++policy);
+		if (policy == SCHED_POLICIES) {
+			fprintf(stderr, "usage: %s [fifo|lifo|random]\n", argv[0]);
+			return 1;
+		}
+	}
+	green_set_policy(policy);
+	printf("Scheduling green threads onto %d workers, %s policy\n", workers, POLICY_NAMES[policy]);
+	
 	for (int i = 0; i < THREAD_COUNT; ++i) {
 		args[i].id = i;
 		args[i].sync = &sync;
@@ -84,7 +107,7 @@ int main() {
 	printf("Running %d green independent tasks\n", THREAD_COUNT);
 	clock_gettime(CLOCK_MONOTONIC, &start_time);
 	for (int i = 0; i < THREAD_COUNT; ++i) green_create(&gthreads[i], independent, &counters[i]);
-	for (int i = 0; i < THREAD_COUNT; ++i) green_join(&gthreads[i]);
+	for (int i = 0; i < THREAD_COUNT; ++i) green_join(&gthreads[i], NULL);
 	greens[0] = get_time_since(&start_time);
 	printf("%d green independent tasks finished in %f%s\n", THREAD_COUNT, greens[0], TIME_UNIT);
 #endif // ENABLE_INDEPENDENT
@@ -98,23 +121,30 @@ int main() {
 	printf("Running %d green ordered tasks\n", THREAD_COUNT);
 	clock_gettime(CLOCK_MONOTONIC, &start_time);
 	for (int i = 0; i < THREAD_COUNT; ++i) green_create(&gthreads[i], ordered, &args[i]);
-	for (int i = 0; i < THREAD_COUNT; ++i) green_join(&gthreads[i]);
+	for (int i = 0; i < THREAD_COUNT; ++i) green_join(&gthreads[i], NULL);
 	greens[1] = get_time_since(&start_time);
 	printf("%d green ordered tasks finished in %f%s\n", THREAD_COUNT, greens[1], TIME_UNIT);
 	assert(shared_counter == THREAD_COUNT * CYCLE_COUNT);
 #endif // ENABLE_ORDERED
 
 #if ENABLE_SYNCHRONIZED
-	shared_counter = 0;
-	green_mutex_init(&sync.objects.green.mutex);
-	
-	printf("Running %d green synchronized tasks\n", THREAD_COUNT);
-	clock_gettime(CLOCK_MONOTONIC, &start_time);
-	for (int i = 0; i < THREAD_COUNT; ++i) green_create(&gthreads[i], synchronized, &sync);
-	for (int i = 0; i < THREAD_COUNT; ++i) green_join(&gthreads[i]);
-	greens[2] = get_time_since(&start_time);
-	printf("%d green synchronized tasks finished in %f%s\n", THREAD_COUNT, greens[2], TIME_UNIT);
-	assert(shared_counter == THREAD_COUNT * CYCLE_COUNT);
+	for (int mode = 0; mode < MUTEX_MODES; ++mode) {
+		shared_counter = 0;
+		green_mutex_init(&sync.objects.green.mutex);
+		green_mutex_setmode(&sync.objects.green.mutex, mode);
+		
+		printf("Running %d green synchronized tasks (%s mutex)\n", THREAD_COUNT, MODE_NAMES[mode]);
+		unsigned long switches = green_switch_count();
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+		for (int i = 0; i < THREAD_COUNT; ++i) green_create(&gthreads[i], synchronized, &sync);
+		for (int i = 0; i < THREAD_COUNT; ++i) green_join(&gthreads[i], NULL);
+		modes[mode] = get_time_since(&start_time);
+		switch_rates[mode] = (double)(green_switch_count() - switches) / (THREAD_COUNT * CYCLE_COUNT);
+		printf("%d green synchronized tasks finished in %f%s, %f switches per lock\n",
+			THREAD_COUNT, modes[mode], TIME_UNIT, switch_rates[mode]);
+		assert(shared_counter == THREAD_COUNT * CYCLE_COUNT);
+	}
+	greens[2] = modes[GREEN_MUTEX_BARGING];
 #endif // ENABLE_SYNCHRONIZED
 #endif // ENABLE_GREEN
 
@@ -175,6 +205,13 @@ int main() {
 #endif // ENABLE_SYNCHRONIZED
 #endif // ENABLE_GREEN || ENABLE_PTHREAD
 	
+#if ENABLE_GREEN && ENABLE_SYNCHRONIZED
+	printf("\n  mutex mode  ||  green   || switches/lock\n");
+	for (int mode = 0; mode < MUTEX_MODES; ++mode) {
+		printf("%12s ||%8.2f%s|| %f\n", MODE_NAMES[mode], modes[mode], TIME_UNIT, switch_rates[mode]);
+	}
+#endif // ENABLE_GREEN && ENABLE_SYNCHRONIZED
+
 	printf("done\n");
 }
 
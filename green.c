@@ -1,19 +1,76 @@
 #include "green.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ucontext.h>
+#include <unistd.h>
 
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id	_sigev_un._tid	// older glibc doesn't name the field
+#endif
 
 #define FALSE		0
 #define TRUE		1
 
-#define PERIOD		100
+#ifndef PREEMPTIVE
+#define PREEMPTIVE	1	// 0 builds a cooperative scheduler, with no timer signal and no critical section bookkeeping
+#endif
+#define PERIOD		100	// default preemption quantum in microseconds, the green_maybe_yield() slice in a cooperative build
+#define KEYS_MAX	128	// thread-specific data keys, the first GREEN_KEYS_INLINE live in green_t
+#define KEY_PASSES	4	// destructor rounds on exit, they may set values again
+#define CALIBRATE_NS	20000	// how long init() times the cycle counter against CLOCK_MONOTONIC
+
+#define STACK_SIZE	16384	// default, the timer handler and its signal frame live on the thread's stack too
+#define STACK_MIN	8192	// smallest size class, the signal frame alone can take a few KiB
+#define STACK_CLASSES	9	// size classes double from STACK_MIN, larger stacks are not pooled
+
+#define STACK_PATTERN	0xA5A5A5A5A5A5A5A5ULL	// profiled stacks are filled with this
+#define STACK_HEADROOM	4096	// on top of the deepest profiled use, the timer's signal frame might not have been there
+#define PROFILE_SLOTS	256		// entry functions we keep a stack profile for
+
+#define FD_CHUNK		1024	// fd states are allocated this many at a time
+#define FD_CHUNKS		1024	// so we support fds up to FD_CHUNK * FD_CHUNKS
+#define POLL_EVENTS		64		// events taken from epoll at once
 
-#define STACK_SIZE	4096
+#ifndef IO_URING
+#define IO_URING		1		// file I/O goes through io_uring if the kernel allows, 0 always uses helper threads
+#endif
+#define RING_ENTRIES	256
+#define RING_BATCH		16		// queued submissions worth a syscall even while the worker has other threads to run
+#define HELPER_THREADS	4		// run offloaded calls, and file I/O when io_uring is not available
+
+#define MUTEX_STARVE_NS	1000000	// adaptive mutexes hand off once waiters went this long without it
+
+#define LIFO_STREAK	8	// wakeups in a row the LIFO policy runs next before one goes to the back
+#define PRIORITIES		3	// green_priority classes, each has its own run queue
+#define AGING_PASSES	16	// picks a runnable class can be passed over before it runs anyway
+
+#define MAX_WORKERS	64
+#define STACK_CACHE	64	// free stacks a worker keeps to itself before handing them to the shared pool
+#define THREAD_CACHE	64	// free green_create_detached() structures a worker keeps to itself
+#define THREAD_BATCH	64	// structures allocated at once when the pools run dry
+#define JOIN_INLINE	8	// join group watches kept on the caller's stack, more are allocated
+#define SELECT_INLINE	8	// green_select() cases kept on the caller's stack, more are allocated
+#define SPIN_LIMIT	128	// spins before a lock waiter gives its core away
 
 // These are safety marks, disabling this saves 1 cycle per function each
 // (assert might be more), but enabling this makes debugging easier
@@ -23,18 +80,284 @@
 #define CLEAN_NEXT			1	// Make sure the green_t.next is NULL on a freshly popped thread
 #define NON_EMPTY_ASSERT	1	// Check queue emptiness on popping
 
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()	__builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax()	__asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax()	__asm__ __volatile__("" ::: "memory")
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define read_cycles()	__builtin_ia32_rdtsc()
+#elif defined(__aarch64__)
+static inline unsigned long read_cycles() {
+	unsigned long cycles;
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(cycles));
+	return cycles;
+}
+#else
+#define read_cycles()	monotonic_ns()	// no cheap counter, the clock will do
+#endif
+
+
+/// Per OS thread scheduler state
+///
+/// Every worker owns a run queue, other workers only touch it to steal
+/// The deferred fields are work the previous context could not do itself,
+/// because its context was not saved yet, they are done by finish_switch()
+typedef struct worker_t {
+	int				lock;		// spinlock guarding ready, count and passed
+	green_queue_t	ready[PRIORITIES];	// one run queue per green_priority class
+	volatile int	count;		// threads in all of ready, read without the lock by thieves
+	int				passed[PRIORITIES];	// picks that went to another class while this one had threads
+	
+	green_t			*running;
+	unsigned long	switches;	// context switches done on this worker
+	unsigned long	slice_start;	// read_cycles() when the running thread got the worker
+	unsigned long	polled_at;	// read_cycles() of the last poll_events() by yield(), when nothing ticks
+	
+	green_t			idle;		// scheduler loop the worker falls back to when out of work
+	
+	int				*unlock;	// deferred: spinlock protecting the queue the previous thread parked on
+	green_t			*requeue;	// deferred: the previous thread is still runnable
+	void			*retire;	// deferred: the previous thread finished, recycle its stack
+	size_t			retire_size;
+	green_t			*reclaim;	// deferred: the previous thread was pooled, recycle its structure
+	green_t			*park;		// deferred: the previous thread parked, publish that it's off its stack
+	struct io_request_t	*submit;	// deferred: the previous thread parked on this request, start it
+	
+	void			*stacks[STACK_CLASSES];	// free stacks per size class, linked through their first word
+	int				stack_count[STACK_CLASSES];
+	green_t			*spare_threads;	// free pooled structures, linked through next
+	int				spare_count;
+	
+	unsigned int	seed;		// picks the first steal victim and random policy wakeups
+	int				streak;		// wakeups put in front in a row by the LIFO policy
+	
+	pid_t			tid;		// the OS thread, GREEN_CLOCK_MONOTONIC timers signal it directly
+	timer_t			ticker;
+	int				has_ticker;
+	int				ticking;	// ticker is armed
+	pthread_t		pthread;
+} worker_t;
+
+
+static green_t			main_green;
+
+static worker_t			workers[MAX_WORKERS];
+static int				worker_count = 1;
+static int				concurrent = FALSE;	// more than one worker, until then the key area alone excludes everyone
+static int				workers_lock;	// serializes green_set_concurrency
+static int				policy = GREEN_SCHED_FIFO;
+
+// Preemption timer, ITIMER_VIRTUAL for the process or one CLOCK_MONOTONIC timer per worker
+static unsigned long	quantum = PERIOD * 1000;	// ns, 0 when preemption is off
+static int				quantum_clock = GREEN_CLOCK_CPU;
+static int				tickless = FALSE;
+#if PREEMPTIVE
+static int				cpu_ticking;	// ITIMER_VIRTUAL is armed
+#endif // PREEMPTIVE
+static int				ticks_lock;		// serializes arming and disarming
+static unsigned long	slice_cycles;	// the quantum in read_cycles() units, for green_maybe_yield()
+static unsigned long	period_cycles;	// PERIOD in read_cycles() units, how often yield() polls with a quantum of 0
+static double			cycles_per_ns;
+
+// Thread-specific data keys, created ones are never reused
+static void		(*key_destructors[KEYS_MAX])(void *);
+static unsigned int	key_count;
+static int		keys_lock;
+
+// Stacks no worker kept for itself, linked through their first word
+static void				*shared_stacks[STACK_CLASSES];
+static int				stacks_lock;
+static size_t			page_size;
+
+// Pooled structures no worker kept for itself, linked through next
+static green_t			*shared_threads;
+static int				threads_lock;
+
+// Deepest stack use per entry function, an open addressing table
+typedef struct stack_profile_t {
+	void	*(*func)(void *);
+	size_t	peak;
+} stack_profile_t;
+
+static stack_profile_t	profiles[PROFILE_SLOTS];
+static int				profiles_lock;
+static int				profiling = FALSE;
+
+// Idle workers sleep on idle_seq, waking bumps it so no wake up is lost between check and sleep
+static int				idle_workers;
+static int				idle_seq;
+
+/// Waiter parked on a file descriptor, lives on the waiting thread's stack
+typedef struct fd_waiter_t {
+	green_t	*thread;
+	int		events;		// what it waits for
+	int		revents;	// what woke it
+	struct fd_waiter_t	*next[2];	// on the readers and writers lists, a waiter for both is on both
+} fd_waiter_t;
+
+/// What we know about a file descriptor registered with epoll
+///
+/// The registration is edge-triggered, so an edge with nobody waiting is kept in ready
+/// for the next waiter, otherwise it would be lost
+typedef struct fd_state_t {
+	int			lock;
+	fd_waiter_t	*waiters[2];	// FD_IN and FD_OUT, every thread waiting for that direction
+	int			ready;
+} fd_state_t;
+
+enum fd_direction {FD_IN, FD_OUT};
+
+static fd_state_t		*fd_chunks[FD_CHUNKS];
+static int				fd_chunks_lock;
+
+// One idle worker at a time sleeps in epoll_wait, the rest on idle_seq
+// wake_fd gets it out when new work appears
+static int				poll_fd = -1;
+static int				wake_fd = -1;
+static int				polling;
+static int				io_waiters;	// threads parked on fds, nobody needs to poll without them
 
-static ucontext_t		main_context = {0};
-static green_t			main_green = {&main_context, NULL, NULL, NULL, NULL, FALSE};
+/// A file operation or offloaded call a parked thread waits on, lives on the thread's stack
+///
+/// It's only submitted once the thread is parked, so the completion can't beat the switch
+typedef struct io_request_t {
+	green_t				*thread;
+	int					opcode;		// IORING_OP_READV, IORING_OP_WRITEV or IORING_OP_FSYNC
+	int					fd;
+	struct iovec		iov;
+	off_t				offset;
+	ssize_t				result;		// what the syscall returned, negated errno on failure
+	void				*(*func)(void *);	// an offloaded call instead of a file operation
+	void				*arg;
+	void				*value;		// what the offloaded call returned
+	unsigned long		submitted;	// CLOCK_MONOTONIC ns, for the latency statistics
+	struct io_request_t	*next;		// helper queue link
+} io_request_t;
 
-static sigset_t			block;
+/// Our io_uring, the queues are shared with the kernel
+typedef struct ring_t {
+	int					fd;
+	int					lock;
+	
+	unsigned			*sq_tail, *sq_mask, *sq_array;
+	unsigned			*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	unsigned			cq_entries;
+	
+	unsigned			queued;		// in the submission queue, the kernel doesn't know yet
+	volatile unsigned	inflight;	// submitted, completion not reaped yet
+} ring_t;
+
+enum io_backend {IO_UNKNOWN, IO_RING, IO_HELPERS};
+
+static ring_t			ring = {.fd = -1};
+static enum io_backend	io_backend = IO_UNKNOWN;
+static int				io_backend_lock;
+
+// Requests for the helper threads, they block so they get a real mutex
+static pthread_mutex_t	helpers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	helpers_cond = PTHREAD_COND_INITIALIZER;
+static io_request_t		*helper_front, *helper_back;
+static unsigned			helpers_started, helpers_idle;
+static green_offload_stats_t	helper_stats;
+
+/// A thread blocked on one or more channel operations
+///
+/// The first to complete one of them claims it, every other queued case is stale from then on
+typedef struct chan_select_t {
+	green_t					*thread;
+	int						claimed;
+	int						fired;		// index of the case that completed
+	int						ok;			// FALSE if it completed because the channel closed
+	int						multi;		// a select, wakers take lock before waking it
+	int						lock;		// held by a select until it's parked
+	struct chan_select_t	*wake_next;	// claimed threads to wake once the channel is unlocked
+} chan_select_t;
+
+/// One channel operation a thread is blocked on, lives on the thread's stack
+typedef struct green_chan_waiter_t {
+	chan_select_t				*select;
+	void						*data;		// the value to send, or where to receive it
+	int							index;		// case of the select
+	int							queued;
+	struct green_chan_waiter_t	*next, *prev;
+} chan_waiter_t;
+
+enum chan_result {CHAN_DONE, CHAN_BLOCK, CHAN_CLOSED};
+
+/// A thread blocked in green_join_any() or green_join_all()
+///
+/// Every exit among its threads counts remaining down, the one that reaches 0 wakes it
+typedef struct join_group_t {
+	green_t					*thread;
+	int						remaining;	// exits still to come before it wakes, 1 for any
+	int						first;		// index of the thread whose exit woke it
+	int						lock;		// held until it's parked, like chan_select_t.lock
+	struct join_group_t		*wake_next;	// groups to wake once the exiting thread is unlocked
+} join_group_t;
+
+/// A join group's place on one of its threads' green_t.watchers, lives on the waiting thread's stack
+typedef struct join_watch_t {
+	join_group_t			*group;
+	int						index;
+	int						linked;		// guarded by the watched thread's lock
+	int						watched;	// was linked, the thread's lock is taken again before returning
+	struct join_watch_t		*next, *prev;
+} join_watch_t;
+
+// Threads made ready from outside the scheduler, a lock-free stack linked through green_t.next
+static green_t			*inbox;
+
+// Conditions signaled from outside the scheduler, a lock-free stack linked through post_next
+static green_cond_t		*posted_signals;
+
+enum park_state {PARK_NONE, PARK_PERMIT, PARK_PARKED};
+
+enum wait_state {WAIT_PENDING, WAIT_WOKEN, WAIT_EXPIRED};
+
+#define NOT_QUEUED		UINT_MAX
+#define NOT_READY		-1		// green_t.ready_on of a thread that isn't on a run queue
+#define PREEMPT_WAKEUP	2		// preempt_pending for a higher class thread woken, rather than the timer
+
+/// A thread sleeping until a deadline, lives on the thread's stack
+///
+/// A timed wait is also on a wait queue, whoever moves the state off WAIT_PENDING first,
+/// the deadline or a wakeup, is the one that makes the thread ready
+typedef struct sleeper_t {
+	green_t			*thread;
+	unsigned long	deadline;	// CLOCK_MONOTONIC ns
+	unsigned		index;		// position in the heap, NOT_QUEUED once off it
+	
+	int				state;
+	green_queue_t	*queue;		// the wait queue, NULL once off it or for a plain sleep
+	int				*lock;		// guarding the wait queue
+	struct sleeper_t	*next;	// expired list
+} sleeper_t;
+
+// Min-heap of sleepers on their deadline
+static sleeper_t		**timers;
+static unsigned			timer_count, timer_capacity;
+static int				timers_lock;
+static volatile unsigned long	next_deadline = ULONG_MAX;	// of the heap's top, read without the lock
 
-static green_t			*running = &main_green;
+static __thread worker_t	*self __attribute__((tls_model("initial-exec")));
 
-static green_queue_t	ready_queue;
+// Interrupts are "blocked" by a plain counter the timer handler checks, instead of the signal mask
+// Both are per worker and always accessed directly, never through a pointer loaded earlier,
+// so a thread that got preempted and resumed elsewhere touches its new worker's copy
+#if PREEMPTIVE
+static __thread volatile int	interrupts_off __attribute__((tls_model("initial-exec")));
+#endif // PREEMPTIVE
+static __thread volatile int	preempt_pending __attribute__((tls_model("initial-exec")));	// the timer fired while interrupts were off, or PREEMPT_WAKEUP
 
 
 static inline void push_queue(green_queue_t *queue, green_t *thread) {
+	thread->prev = queue->back;
 	queue->back = (queue->back) ? (queue->back->next = thread) : (queue->front = thread);
 }
 
@@ -45,7 +368,11 @@ static inline green_t *pop_queue(green_queue_t *queue) {
 	green_t *thread = queue->front;
 	queue->front = thread->next;
 	
-	if (thread->next == NULL) queue->back = NULL;
+	if (thread->next == NULL) {
+		queue->back = NULL;
+	} else {
+		thread->next->prev = NULL;
+	}
 
 #if CLEAN_NEXT
 	thread->next = NULL;
@@ -54,234 +381,3201 @@ static inline green_t *pop_queue(green_queue_t *queue) {
 	return thread;
 }
 
+static inline void push_front_queue(green_queue_t *queue, green_t *thread) {
+	thread->prev = NULL;
+	thread->next = queue->front;
+	if (queue->front != NULL) {
+		queue->front->prev = thread;
+	} else {
+		queue->back = thread;
+	}
+	queue->front = thread;
+}
+
+/// Take a thread out of the queue wherever it is
+static inline void remove_queue(green_queue_t *queue, green_t *thread) {
+	if (thread->prev != NULL) {
+		thread->prev->next = thread->next;
+	} else {
+		queue->front = thread->next;
+	}
+	
+	if (thread->next != NULL) {
+		thread->next->prev = thread->prev;
+	} else {
+		queue->back = thread->prev;
+	}
+	
+	thread->next = thread->prev = NULL;
+}
+
 static inline void init_queue(green_queue_t *queue) {
 	queue->front = queue->back = NULL;
 }
 
+#if PREEMPTIVE
+static void preempt();
+
 static inline void block_interrupts() {
-	sigprocmask(SIG_BLOCK, &block, NULL);
+	interrupts_off++;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
 }
 
+/// Leave the key area, taking the switch the timer asked for in the meantime
 static inline void unblock_interrupts() {
-	sigprocmask(SIG_UNBLOCK, &block, NULL);
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	if (interrupts_off == 1 && preempt_pending) preempt();
+	interrupts_off--;
+}
+#else
+// Nothing switches threads behind their back, so there is nothing to keep out
+static inline void block_interrupts() {}
+static inline void unblock_interrupts() {}
+#endif // PREEMPTIVE
+
+// Spinlocks are only ever held with interrupts blocked, so the holder can't be switched out
+static inline void spin_lock(int *lock) {
+	if (!concurrent) {
+		*lock = TRUE;
+		return;
+	}
+	
+	int spins = 0;
+	while (__atomic_exchange_n(lock, TRUE, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+			if (++spins < SPIN_LIMIT) {
+				cpu_relax();
+			} else {
+				spins = 0;
+				sched_yield();	// the holder's OS thread might be off the core
+			}
+		}
+	}
+}
+
+static inline int spin_trylock(int *lock) {
+	if (!concurrent) {
+		*lock = TRUE;
+		return TRUE;
+	}
+	
+	return !__atomic_exchange_n(lock, TRUE, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_unlock(int *lock) {
+	__atomic_store_n(lock, FALSE, __ATOMIC_RELEASE);
+}
+
+static inline int futex(int *address, int op, int value) {
+	return syscall(SYS_futex, address, op, value, NULL, NULL, 0);
+}
+
+static unsigned long monotonic_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+#if GREEN_UCONTEXT
+
+static inline void context_switch(green_context_t *from, green_context_t *to) {
+	swapcontext(from, to);
+}
+
+static inline void context_load(green_context_t *to) {
+	setcontext(to);
+}
+
+/// Prepare a context that calls entry on the given stack once switched to
+///
+/// The context takes the signal mask of the caller with it
+static void context_make(green_context_t *context, void *stack, size_t size, void (*entry)()) {
+	getcontext(context);
+	
+	// We need to initialize uc_stack struct of the context before calling makecontext
+	context->uc_stack.ss_sp = stack;
+	context->uc_stack.ss_size = size;
+	
+	makecontext(
+		context,	// The context to modify
+		entry,		// The function that is called when the context activates
+		0);			// number of int arguments to the above function
+}
+
+#else
+
+/// Push the callee-saved registers, store the stack pointer to *from and pop the registers saved at to
+///
+/// Everything else is already saved by the caller as per the calling convention,
+/// we skip the signal mask and FP state swapcontext saves, as no switch needs them
+void green_switch(void **from, void *to);
+
+#if defined(__x86_64__)
+__asm__(
+	".text\n"
+	".globl green_switch\n"
+	".hidden green_switch\n"
+	".type green_switch, @function\n"
+	"green_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"		// SSE and x87 control words are callee-saved too
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size green_switch, .-green_switch\n");
+
+#define FRAME_WORDS	8	// control words, 6 registers and the return address
+#define FRAME_ENTRY	7
+#define FRAME_PAD	1	// entry expects a return address on top of an aligned stack
+#define FRAME_CONTROL	(((uintptr_t)0x037F << 32) | 0x1F80)	// default fcw and mxcsr
+#elif defined(__aarch64__)
+__asm__(
+	".text\n"
+	".globl green_switch\n"
+	".hidden green_switch\n"
+	".type green_switch, %function\n"
+	"green_switch:\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".size green_switch, .-green_switch\n");
+
+#define FRAME_WORDS	20	// x19 to x30 and d8 to d15
+#define FRAME_ENTRY	11	// x30, the link register
+#define FRAME_PAD	0
+#define FRAME_CONTROL	0
+#endif
+
+static inline void context_switch(green_context_t *from, green_context_t *to) {
+	green_switch(&from->sp, to->sp);
+}
+
+static inline void context_load(green_context_t *to) {
+	void *discard;
+	green_switch(&discard, to->sp);
+}
+
+/// Prepare a context that calls entry on the given stack once switched to
+///
+/// Lays out a frame as if green_switch had saved it, returning into entry
+static void context_make(green_context_t *context, void *stack, size_t size, void (*entry)()) {
+	// The ABI wants a 16 byte aligned stack, entry never returns so its return address is NULL
+	void **end = (void **)(((uintptr_t)stack + size) & ~(uintptr_t)15);
+	void **frame = end - FRAME_PAD - FRAME_WORDS;
+	
+	for (int i = 0; i < FRAME_WORDS + FRAME_PAD; ++i) frame[i] = NULL;
+	frame[0] = (void *)FRAME_CONTROL;
+	frame[FRAME_ENTRY] = (void *)entry;
+	
+	context->sp = frame;
+}
+
+#endif // GREEN_UCONTEXT
+
+/// The worker the calling code runs on
+///
+/// A green thread can resume on a different worker after any switch, so the result
+/// must not be kept across one, and only asked for with interrupts blocked
+/// It is out of line so the compiler can't reuse a thread pointer it loaded before a switch
+static worker_t *current_worker() __attribute__((noinline));
+
+static worker_t *current_worker() {
+	return self;
 }
 
 
+#if PREEMPTIVE
 void timer_handler(int);
+#endif // PREEMPTIVE
 
 
 static void init()	__attribute__((constructor));	// why hate on C, only any library you add can have an invisible initialize function
 
+static void idle_entry();
+static void *get_stack(worker_t *worker, size_t size);
+#if PREEMPTIVE
+static void set_ticks(worker_t *worker, int on);
+#endif // PREEMPTIVE
+
 
 void init() {
-	getcontext(&main_context);
+	// The calling thread is the first worker
+	worker_t *worker = &workers[0];
+	for (int class = 0; class < PRIORITIES; ++class) init_queue(&worker->ready[class]);
+	worker->running = &main_green;
+	main_green.ready_on = NOT_READY;
+	main_green.priority = GREEN_PRIORITY_NORMAL;
+	worker->pthread = pthread_self();
+	worker->tid = syscall(SYS_gettid);
+	self = worker;
 	
-	init_queue(&ready_queue);
+	page_size = sysconf(_SC_PAGESIZE);
 	
-	// Initialize scheduler timer
-	sigemptyset(&block);
-	sigaddset(&block, SIGVTALRM);
+	poll_fd = epoll_create1(EPOLL_CLOEXEC);
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	assert(poll_fd >= 0 && wake_fd >= 0);
 	
+	struct epoll_event wake = {0};
+	wake.events = EPOLLIN;
+	wake.data.ptr = NULL;	// the only registration without an fd state
+	epoll_ctl(poll_fd, EPOLL_CTL_ADD, wake_fd, &wake);
+	
+	// It needs a stack of its own to idle on, as main might be blocked
+	worker->idle.stack = get_stack(worker, STACK_SIZE);
+	worker->idle.stack_size = STACK_SIZE;
+	assert(worker->idle.stack != NULL);
+	context_make(&worker->idle.context, worker->idle.stack, STACK_SIZE, idle_entry);
+	
+	// Time the cycle counter, so green_maybe_yield() can measure a slice without a system call
+	unsigned long start_ns = monotonic_ns(), start_cycles = read_cycles(), ns;
+	while ((ns = monotonic_ns() - start_ns) < CALIBRATE_NS) cpu_relax();
+	cycles_per_ns = (double)(read_cycles() - start_cycles) / ns;
+	slice_cycles = quantum * cycles_per_ns;
+	period_cycles = PERIOD * 1000 * cycles_per_ns;
+	worker->slice_start = read_cycles();
+
+#if PREEMPTIVE
 	struct sigaction action = {0};
-	struct timeval interval;
-	struct itimerval period;
 	
+	// The handler switches threads without returning, so it must not leave the signal blocked behind
 	action.sa_handler = timer_handler;
+	action.sa_flags = SA_NODEFER | SA_RESTART;
 	int result = sigaction(
 		SIGVTALRM,	// the signal for which to set the action
 		&action,	// the action to call for the signal
 		NULL);		// the out pointer to store old action
-		
+	
 	assert(result == 0);
 	
-	interval.tv_sec = 0;
-	interval.tv_usec = PERIOD;
+	set_ticks(worker, TRUE);	// ITIMER_VIRTUAL until green_set_quantum() says otherwise
+#endif // PREEMPTIVE
+}
+
+/// Round a requested stack size up to what we'll actually map
+static size_t stack_size_for(size_t size) {
+	size_t class = STACK_MIN;
+	for (int i = 0; i < STACK_CLASSES; ++i, class <<= 1) {
+		if (size <= class) return class;
+	}
 	
-	period.it_interval = interval;
-	period.it_value = interval;
-	setitimer(
-		ITIMER_VIRTUAL,	// use user-time
-		&period,		// the new itimerval to set to
-		NULL);			// the out pointer for old itimerval
+	// Too large to pool, just round to pages
+	return (size + page_size - 1) & ~(page_size - 1);
 }
 
-void green_thread() {
-	green_t *this = running;
+/// The pool a stack size belongs to, -1 if it's not pooled
+static int stack_class(size_t size) {
+	size_t class = STACK_MIN;
+	for (int i = 0; i < STACK_CLASSES; ++i, class <<= 1) {
+		if (size == class) return i;
+	}
 	
-	(*this->func)(this->arg);	// execute user function
+	return -1;
+}
+
+/// Map a fresh stack with a guard page below it, so an overflow faults right away
+///
+/// The memory is only reserved, pages get backed as the thread touches them
+/// Every stack takes two mappings, so vm.max_map_count caps the number of live threads
+static void *map_stack(size_t size) {
+	char *mapping = mmap(NULL, page_size + size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+	if (mapping == MAP_FAILED) return NULL;
 	
-	// We are in key area, so make sure not to corrupt any queues
-	// Place waiting thread to the ready queue
-	block_interrupts();
-	while (this->join != NULL) {
-		push_queue(&ready_queue, this->join);
-		this->join = this->join->next;
+	if (mprotect(mapping, page_size, PROT_NONE) != 0) {
+		munmap(mapping, page_size + size);
+		return NULL;
 	}
-	unblock_interrupts();
 	
-	// Free allocated memory
-	free(this->context->uc_stack.ss_sp);
-	free(this->context);
+	return mapping + page_size;
+}
+
+/// Take a stack from the worker's cache, the shared pool or as a last resort a new mapping
+///
+/// Expects interrupts blocked and a size from stack_size_for(), returns NULL if we're out of memory
+static void *get_stack(worker_t *worker, size_t size) {
+	int class = stack_class(size);
+	if (class < 0) return map_stack(size);
 	
-	// this thread is now a zombie
-	this->zombie = TRUE;
+	void *stack = worker->stacks[class];
+	if (stack != NULL) {
+		worker->stacks[class] = *(void **)stack;
+		worker->stack_count[class]--;
+		return stack;
+	}
 	
-	block_interrupts();
-	running = pop_queue(&ready_queue);
-	setcontext(running->context);
-	unblock_interrupts();
+	if (shared_stacks[class] != NULL) {
+		spin_lock(&stacks_lock);
+		stack = shared_stacks[class];
+		if (stack != NULL) shared_stacks[class] = *(void **)stack;
+		spin_unlock(&stacks_lock);
+		
+		if (stack != NULL) return stack;
+	}
+	
+	return map_stack(size);
 }
 
-int green_create(green_t *new, void *(*func)(void *), void *arg) {
-	ucontext_t *context = (ucontext_t *)malloc(sizeof(ucontext_t));
-	getcontext(context);
+/// Give a stack nobody runs on any more back for reuse
+///
+/// Expects interrupts blocked
+static void put_stack(worker_t *worker, void *stack, size_t size) {
+	int class = stack_class(size);
+	if (class < 0) {
+		munmap((char *)stack - page_size, page_size + size);
+		return;
+	}
 	
-	void *stack = malloc(STACK_SIZE);	// hmm the context example allocated stack on the stack for some reason
+	// A deep call would leave a large stack backed for every thread that gets it next,
+	// only the lowest page stays, it holds the free list link
+	if (size > STACK_SIZE) madvise((char *)stack + page_size, size - page_size, MADV_DONTNEED);
 	
-	// We need to initialize uc_stack struct of the context before calling makecontext
-	context->uc_stack.ss_sp = stack;
-	context->uc_stack.ss_size = STACK_SIZE;
+	if (worker->stack_count[class] < STACK_CACHE) {
+		*(void **)stack = worker->stacks[class];
+		worker->stacks[class] = stack;
+		worker->stack_count[class]++;
+		return;
+	}
 	
-	makecontext(
-		context,		// The context to modify
-		green_thread,	// The function that is called when the thread activates
-		0);				// number of int arguments to the above function
+	spin_lock(&stacks_lock);
+	*(void **)stack = shared_stacks[class];
+	shared_stacks[class] = stack;
+	spin_unlock(&stacks_lock);
+}
+
+/// Take a structure for a pooled thread from the worker's cache, the shared pool or a new batch
+///
+/// Expects interrupts blocked, returns NULL if we're out of memory
+static green_t *get_thread(worker_t *worker) {
+	green_t *thread = worker->spare_threads;
+	if (thread != NULL) {
+		worker->spare_threads = thread->next;
+		worker->spare_count--;
+		return thread;
+	}
 	
-	// Initialize the thread structure
-	new->context = context;
-	new->func = func;
-	new->arg = arg;
-	new->next = NULL;
-	new->join = NULL;
-	new->zombie = FALSE;
+	if (shared_threads != NULL) {
+		spin_lock(&threads_lock);
+		thread = shared_threads;
+		if (thread != NULL) shared_threads = thread->next;
+		spin_unlock(&threads_lock);
+		
+		if (thread != NULL) return thread;
+	}
 	
-	block_interrupts();
-	push_queue(&ready_queue, new);
-	unblock_interrupts();
+	// Structures are never freed, so a batch is only ever allocated for a new peak of live threads
+	green_t *batch = calloc(THREAD_BATCH, sizeof(green_t));
+	if (batch == NULL) return NULL;
 	
-	return 0;
+	for (int i = 1; i < THREAD_BATCH; ++i) {
+		batch[i].next = worker->spare_threads;
+		worker->spare_threads = &batch[i];
+	}
+	worker->spare_count += THREAD_BATCH - 1;
+	
+	return &batch[0];
 }
 
-int green_yield() {
-	block_interrupts();
-	green_t *suspended = running;
-	
-	push_queue(&ready_queue, suspended);
+/// Give the structure of a pooled thread that exited back for reuse
+///
+/// Expects interrupts blocked
+static void put_thread(worker_t *worker, green_t *thread) {
+	if (worker->spare_count < THREAD_CACHE) {
+		thread->next = worker->spare_threads;
+		worker->spare_threads = thread;
+		worker->spare_count++;
+		return;
+	}
 	
-	running = pop_queue(&ready_queue);
-	swapcontext(suspended->context, running->context);
-	unblock_interrupts();
+	spin_lock(&threads_lock);
+	thread->next = shared_threads;
+	shared_threads = thread;
+	spin_unlock(&threads_lock);
+}
+
+/// The profile slot of an entry function, NULL if the table is full
+///
+/// Expects profiles_lock taken
+static stack_profile_t *find_profile(void *(*func)(void *)) {
+	size_t start = ((uintptr_t)func >> 4) % PROFILE_SLOTS;
+	for (size_t i = 0; i < PROFILE_SLOTS; ++i) {
+		stack_profile_t *profile = &profiles[(start + i) % PROFILE_SLOTS];
+		if (profile->func == func || profile->func == NULL) return profile;
+	}
 	
-	return 0;
+	return NULL;
 }
 
-int green_join(green_t *thread) {
-	if (thread->zombie) return 0;
+/// How deep the pattern has been eaten into from the top of the stack
+static size_t measure_stack(void *stack, size_t size) {
+	uint64_t *word = (uint64_t *)stack;
+	uint64_t *end = (uint64_t *)((char *)stack + size);
+	while (word < end && *word == STACK_PATTERN) ++word;
 	
+	return (char *)end - (char *)word;
+}
+
+static void record_stack_peak(void *(*func)(void *), size_t peak) {
+	spin_lock(&profiles_lock);
+	stack_profile_t *profile = find_profile(func);
+	if (profile != NULL) {
+		profile->func = func;
+		if (peak > profile->peak) profile->peak = peak;
+	}
+	spin_unlock(&profiles_lock);
+}
+
+void green_stack_profile(int enable) {
+	profiling = enable;
+}
+
+size_t green_stack_peak(void *(*func)(void *)) {
 	block_interrupts();
-	green_t *suspended = running;
+	spin_lock(&profiles_lock);
+	stack_profile_t *profile = find_profile(func);
+	size_t peak = (profile != NULL && profile->func == func) ? profile->peak : 0;
+	spin_unlock(&profiles_lock);
+	unblock_interrupts();
 	
-	// This is smart
-	// Make next null if we're the only ones waiting
-	// Make next something if someone is already waiting
-	suspended->next = thread->join;
-	thread->join = suspended;
+	return peak;
+}
+
+/// Wake a sleeping worker if there is any
+///
+/// Only makes syscalls, so it's fine to call from signal handlers and foreign threads
+static void wake_any() {
+	// Pairs with the fence in idle_wait(), either we see the sleeper or it sees the work
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&idle_workers, __ATOMIC_RELAXED) == 0) return;
 	
-	running = pop_queue(&ready_queue);
-	swapcontext(suspended->context, running->context);
-	unblock_interrupts();
+	__atomic_add_fetch(&idle_seq, 1, __ATOMIC_SEQ_CST);
 	
-	return 0;
+	// Nobody on the futex, the idle one might be in epoll_wait
+	if (futex(&idle_seq, FUTEX_WAKE_PRIVATE, 1) == 0 && __atomic_load_n(&polling, __ATOMIC_SEQ_CST)) {
+		eventfd_write(wake_fd, 1);
+	}
 }
 
-void green_cond_init(green_cond_t *condition) {
-	init_queue(&condition->queue);
+/// Wake a sleeping worker if there is any, as new work has appeared
+static void wake_idle() {
+	if (!concurrent) return;	// the only worker is the one pushing
+	
+	wake_any();
 }
 
-int green_cond_wait(green_cond_t *condition, green_mutex_t *mutex) {
-	block_interrupts();
-	green_t *suspended = running;
-	push_queue(&condition->queue, suspended);
+#if PREEMPTIVE
+/// Arm or disarm the timer preempting the worker's threads
+///
+/// With GREEN_CLOCK_CPU it is the one process timer whichever worker is passed
+/// Expects ticks_lock held
+static void set_ticks(worker_t *worker, int on) {
+	unsigned long ns = on ? quantum : 0;
+	struct timespec period = {ns / 1000000000, ns % 1000000000};
 	
-	if (mutex != NULL) {
-		// Mirror green_mutex_unlock without signal unblocking	
-		if (mutex->queue.front != NULL) {
-			push_queue(&ready_queue, pop_queue(&mutex->queue));
-		}
+	if (quantum_clock == GREEN_CLOCK_CPU) {
+		struct timeval interval = {period.tv_sec, period.tv_nsec / 1000};
+		if (ns > 0 && interval.tv_sec == 0 && interval.tv_usec == 0) interval.tv_usec = 1;
 		
-		mutex->taken = FALSE;
+		struct itimerval value = {interval, interval};
+		setitimer(ITIMER_VIRTUAL, &value, NULL);
+		__atomic_store_n(&cpu_ticking, on, __ATOMIC_SEQ_CST);
+	} else if (worker->has_ticker) {
+		struct itimerspec value = {period, period};
+		timer_settime(worker->ticker, 0, &value, NULL);
+		__atomic_store_n(&worker->ticking, on, __ATOMIC_SEQ_CST);
+	}
+}
+
+static inline int *ticking(worker_t *worker) {
+	return (quantum_clock == GREEN_CLOCK_CPU) ? &cpu_ticking : &worker->ticking;
+}
+
+/// Whether a tick could do anything for the worker, in tickless mode its timer stops otherwise
+static int wants_ticks(worker_t *worker) {
+	if (quantum_clock == GREEN_CLOCK_MONOTONIC) {
+		if (worker->running == &worker->idle) return FALSE;	// idle_wait() sleeps only as long as it may
+		if (worker->count > 0) return TRUE;
+	} else {
+		// One timer serves every worker
+		int count = __atomic_load_n(&worker_count, __ATOMIC_ACQUIRE);
+		for (int i = 0; i < count; ++i) {
+			if (__atomic_load_n(&workers[i].count, __ATOMIC_RELAXED) > 0) return TRUE;
+		}
 	}
 	
-	running = pop_queue(&ready_queue);
-	swapcontext(suspended->context, running->context);
+	// Ticks also wake sleepers and poll fds while every worker is busy
+	return inbox != NULL || posted_signals != NULL || timer_count > 0 || __atomic_load_n(&io_waiters, __ATOMIC_RELAXED) > 0 || ring.inflight > 0;
+}
+
+/// Arm the worker's timer in tickless mode, as a thread was queued on it
+static inline void start_ticks(worker_t *worker) {
+	if (!tickless) return;
 	
-	// Remember, we got swapped back into focus now
-	if (mutex != NULL) {
-		while (mutex->taken) {
-			push_queue(&mutex->queue, suspended);
-			
-			running = pop_queue(&ready_queue);
-			swapcontext(suspended->context, running->context);
-		}
-		
-		mutex->taken = TRUE;
+	// Pairs with stop_ticks(), either we see the timer stopped or it sees our thread
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(ticking(worker), __ATOMIC_RELAXED)) return;
+	
+	spin_lock(&ticks_lock);
+	if (!*ticking(worker)) set_ticks(worker, TRUE);
+	spin_unlock(&ticks_lock);
+}
+
+/// Disarm the worker's timer in tickless mode, unless something turned up that needs it
+static void stop_ticks(worker_t *worker) {
+	if (!__atomic_load_n(ticking(worker), __ATOMIC_RELAXED)) return;
+	
+	spin_lock(&ticks_lock);
+	__atomic_store_n(ticking(worker), FALSE, __ATOMIC_SEQ_CST);
+	if (wants_ticks(worker)) {
+		__atomic_store_n(ticking(worker), TRUE, __ATOMIC_RELAXED);
+	} else {
+		set_ticks(worker, FALSE);
+	}
+	spin_unlock(&ticks_lock);
+}
+
+/// Arm every timer there is for the current clock
+///
+/// Expects ticks_lock held
+static void start_all_ticks() {
+	int count = __atomic_load_n(&worker_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < count; ++i) {
+		set_ticks(&workers[i], TRUE);
+		if (quantum_clock == GREEN_CLOCK_CPU) break;
 	}
+}
+
+/// Give the worker a CLOCK_MONOTONIC timer that signals its own OS thread
+///
+/// Expects ticks_lock held, returns -1 if the timer can't be created
+static int make_ticker(worker_t *worker) {
+	if (worker->has_ticker) return 0;
 	
-	unblock_interrupts();
+	struct sigevent event = {0};
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = SIGVTALRM;
+	event.sigev_notify_thread_id = worker->tid;
+	if (timer_create(CLOCK_MONOTONIC, &event, &worker->ticker) != 0) return -1;
 	
+	worker->has_ticker = TRUE;
 	return 0;
 }
+#else
+static inline int wants_ticks(worker_t *worker) { return FALSE; }
+static inline void start_ticks(worker_t *worker) {}
+static inline void stop_ticks(worker_t *worker) {}
+#endif // PREEMPTIVE
 
-void green_cond_signal(green_cond_t *condition) {
-	if (condition->queue.front == NULL) return;
+static void push_ready(worker_t *worker, green_t *thread) {
+	spin_lock(&worker->lock);
+	push_queue(&worker->ready[thread->priority], thread);
+	thread->ready_on = worker - workers;
+	worker->count++;
+	spin_unlock(&worker->lock);
+	
+	start_ticks(worker);
+	wake_idle();
+}
 
-	// Fairly straight forward
-	block_interrupts();
-	push_queue(&ready_queue, pop_queue(&condition->queue));
-	unblock_interrupts();
+/// Make a thread runnable ahead of everything else queued on the worker
+static void push_ready_next(worker_t *worker, green_t *thread) {
+	spin_lock(&worker->lock);
+	push_front_queue(&worker->ready[thread->priority], thread);
+	thread->ready_on = worker - workers;
+	worker->count++;
+	spin_unlock(&worker->lock);
+	
+	start_ticks(worker);
+	wake_idle();
 }
 
-void timer_handler(int sig) {
-	green_t *suspended = running;
+/// Make a whole queue of threads runnable on the worker with one pass over its lock
+///
+/// Returns the highest class among them
+static enum green_priority push_ready_all(worker_t *worker, green_queue_t *threads) {
+	enum green_priority highest = GREEN_PRIORITY_BATCH;
+	if (threads->front == NULL) return highest;
 	
-	push_queue(&ready_queue, suspended);
+	spin_lock(&worker->lock);
+	while (threads->front != NULL) {
+		green_t *thread = pop_queue(threads);
+		push_queue(&worker->ready[thread->priority], thread);
+		thread->ready_on = worker - workers;
+		worker->count++;
+		if (thread->priority < highest) highest = thread->priority;
+	}
+	spin_unlock(&worker->lock);
 	
-	running = pop_queue(&ready_queue);
-	swapcontext(suspended->context, running->context);
+	start_ticks(worker);
+	wake_idle();
+	return highest;
 }
 
-void green_mutex_init(green_mutex_t *mutex) {
-	mutex->taken = FALSE;
-	init_queue(&mutex->queue);
+/// Take the next thread from the worker's run queues, the highest class first
+///
+/// Classes lower than floor are only taken when they are due their turn, so a yield doesn't hand
+/// the worker to something less important, returns NULL if nothing qualifies
+static green_t *pop_ready(worker_t *worker, enum green_priority floor) {
+	if (worker->count == 0) return NULL;
+	
+	green_t *thread = NULL;
+	spin_lock(&worker->lock);
+	
+	// Every runnable class passed over ages, one that aged enough goes ahead of the rest
+	int pick = -1;
+	for (int class = 0; class < PRIORITIES; ++class) {
+		if (worker->ready[class].front == NULL) continue;
+		
+		if (pick < 0 && class <= (int)floor) {
+			pick = class;
+			worker->passed[class] = 0;
+		} else if (++worker->passed[class] >= AGING_PASSES) {
+			pick = class;
+			worker->passed[class] = 0;
+			break;
+		}
+	}
+	
+	if (pick >= 0) {
+		thread = pop_queue(&worker->ready[pick]);
+		thread->ready_on = NOT_READY;
+		worker->count--;
+	}
+	spin_unlock(&worker->lock);
+	
+	return thread;
 }
 
-int green_mutex_lock(green_mutex_t *mutex) {
-	block_interrupts();
+/// Have the running thread give way at the next safe point if it is less important than the thread
+///
+/// Only the calling worker can be preempted that way, others get there on their next tick
+static inline void preempt_for(worker_t *worker, enum green_priority priority) {
+	if (priority < worker->running->priority) preempt_pending = PREEMPT_WAKEUP;
+}
+
+/// Make a thread runnable on the calling worker, where the scheduling policy says
+///
+/// The thread is expected to be parked on some wait queue
+static inline void make_ready(green_t *thread) {
+	worker_t *worker = current_worker();
+	preempt_for(worker, thread->priority);
+	
+	switch (__atomic_load_n(&policy, __ATOMIC_RELAXED)) {
+	case GREEN_SCHED_LIFO:
+		// Whatever waits behind a chain of threads waking each other gets its turn eventually
+		if (worker->streak < LIFO_STREAK) {
+			worker->streak++;
+			push_ready_next(worker, thread);
+			return;
+		}
+		worker->streak = 0;
+		break;
+	case GREEN_SCHED_RANDOM:
+		if (rand_r(&worker->seed) & 1) {
+			push_ready_next(worker, thread);
+			return;
+		}
+		break;
+	}
+	
+	push_ready(worker, thread);
+}
+
+/// Take a thread from the front of another worker's queue
+///
+/// The front is the thread that has waited the longest, so it is the fairest to migrate
+static green_t *steal(worker_t *thief, enum green_priority floor) {
+	int count = __atomic_load_n(&worker_count, __ATOMIC_ACQUIRE);
+	if (count == 1) return NULL;
 	
-	green_t *suspended = running;
-	while (mutex->taken) {
-		push_queue(&mutex->queue, suspended);
+	int start = rand_r(&thief->seed) % count;
+	for (int i = 0; i < count; ++i) {
+		worker_t *victim = &workers[(start + i) % count];
+		if (victim == thief) continue;
 		
-		running = pop_queue(&ready_queue);
-		swapcontext(suspended->context, running->context);
+		green_t *thread = pop_ready(victim, floor);
+		if (thread != NULL) return thread;
 	}
 	
-	mutex->taken = TRUE;
-	unblock_interrupts();
+	return NULL;
+}
+
+/// Make a parked thread runnable from anywhere, foreign threads included
+///
+/// The thread lands in the inbox, the next worker to switch or idle takes it
+static void post_ready(green_t *thread) {
+	green_t *head = __atomic_load_n(&inbox, __ATOMIC_RELAXED);
+	do {
+		thread->next = head;
+	} while (!__atomic_compare_exchange_n(&inbox, &head, thread, TRUE, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
 	
-	return 0;
+	wake_any();
 }
 
-int green_mutex_unlock(green_mutex_t *mutex) {
-	block_interrupts();
+/// Move everything posted to the inbox to the worker's queue
+static void drain_inbox(worker_t *worker) {
+	green_t *posted = __atomic_exchange_n(&inbox, NULL, __ATOMIC_ACQUIRE);
 	
-	// Move only one thread, as the only way its one of the suspended onces is it's trying to lock mutex
-	if (mutex->queue.front != NULL) {
-		push_queue(&ready_queue, pop_queue(&mutex->queue));
+	// The inbox is a stack, put it back in the order the threads were posted
+	green_queue_t ordered;
+	init_queue(&ordered);
+	while (posted != NULL) {
+		green_t *next = posted->next;
+		posted->next = ordered.front;
+		posted->prev = NULL;
+		if (ordered.front != NULL) {
+			ordered.front->prev = posted;
+		} else {
+			ordered.back = posted;
+		}
+		ordered.front = posted;
+		posted = next;
 	}
 	
-	mutex->taken = FALSE;
-	unblock_interrupts();
+	push_ready_all(worker, &ordered);
+}
+
+static void reap_ring();
+static void service_ring();
+
+/// Find the next thread to run on the worker, NULL if there is none
+///
+/// Only classes down to floor are considered, see pop_ready(), GREEN_PRIORITY_BATCH takes anything
+/// Also where queued file I/O is submitted, and completed file I/O and posted threads are picked up
+static inline green_t *next_ready(worker_t *worker, enum green_priority floor) {
+	if (ring.queued > 0 || ring.inflight > 0) service_ring();
+	if (inbox != NULL) drain_inbox(worker);
 	
-	return 0;
+	green_t *thread = pop_ready(worker, floor);
+	return (thread != NULL) ? thread : steal(worker, floor);
+}
+
+static void submit_io(worker_t *worker, io_request_t *request);
+
+/// Does the work the previous context left to us
+///
+/// Has to be called right after every switch, in the resumed context
+static void finish_switch() {
+	worker_t *worker = current_worker();
+	
+	if (worker->unlock != NULL) {
+		spin_unlock(worker->unlock);
+		worker->unlock = NULL;
+	}
+	
+	if (worker->requeue != NULL) {
+		push_ready(worker, worker->requeue);
+		worker->requeue = NULL;
+	}
+	
+	if (worker->retire != NULL) {
+		put_stack(worker, worker->retire, worker->retire_size);
+		worker->retire = NULL;
+	}
+	
+	if (worker->reclaim != NULL) {
+		put_thread(worker, worker->reclaim);
+		worker->reclaim = NULL;
+	}
+	
+	// Only now may green_wake() post it, a wake that came while we switched left a permit instead
+	if (worker->park != NULL) {
+		green_t *thread = worker->park;
+		worker->park = NULL;
+		if (!__atomic_compare_exchange_n(&thread->park_state, &(int){PARK_NONE}, PARK_PARKED,
+			FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&thread->park_state, PARK_NONE, __ATOMIC_RELAXED);
+			push_ready(worker, thread);
+		}
+	}
+	
+	if (worker->submit != NULL) {
+		io_request_t *request = worker->submit;
+		worker->submit = NULL;
+		submit_io(worker, request);
+	}
+}
+
+static void switch_to(worker_t *worker, green_t *suspended, green_t *next) {
+	preempt_pending = FALSE;	// whoever asked for a switch is getting one
+	worker->running = next;
+	worker->switches++;
+	worker->slice_start = read_cycles();
+	context_switch(&suspended->context, &next->context);
+	finish_switch();
+}
+
+/// Park the running thread and run something else
+///
+/// Expects interrupts blocked and the thread to be on some wait queue already
+/// The lock guarding that queue is released only once the thread's context is saved,
+/// otherwise another worker could resume it half way through the switch
+static void schedule(int *lock) {
+	worker_t *worker = current_worker();
+	green_t *suspended = worker->running;
+	green_t *next = next_ready(worker, GREEN_PRIORITY_BATCH);
+	
+	worker->unlock = lock;
+	switch_to(worker, suspended, (next != NULL) ? next : &worker->idle);
+}
+
+/// The fd state for a file descriptor, NULL if it's out of range or we're out of memory
+///
+/// Expects interrupts blocked
+static fd_state_t *get_fd_state(int fd) {
+	if (fd < 0 || fd >= FD_CHUNK * FD_CHUNKS) return NULL;
+	
+	fd_state_t **chunk = &fd_chunks[fd / FD_CHUNK];
+	fd_state_t *states = __atomic_load_n(chunk, __ATOMIC_ACQUIRE);
+	if (states == NULL) {
+		spin_lock(&fd_chunks_lock);
+		states = *chunk;
+		if (states == NULL) {
+			states = calloc(FD_CHUNK, sizeof(fd_state_t));
+			__atomic_store_n(chunk, states, __ATOMIC_RELEASE);
+		}
+		spin_unlock(&fd_chunks_lock);
+		
+		if (states == NULL) return NULL;
+	}
+	
+	return &states[fd % FD_CHUNK];
+}
+
+/// Take a waiter off the list of one direction, expects the state locked
+static void unlink_fd_waiter(fd_state_t *state, fd_waiter_t *waiter, int direction) {
+	fd_waiter_t **link = &state->waiters[direction];
+	while (*link != NULL && *link != waiter) link = &(*link)->next[direction];
+	if (*link != NULL) *link = waiter->next[direction];
+}
+
+/// Hand an event over to every waiter of a direction, taking them off both lists
+///
+/// The registration is edge-triggered, so waking only one could strand the rest
+/// if it doesn't use the readiness up, those that find nothing just wait again
+/// Expects the state locked, returns FALSE if nobody is waiting there
+static int wake_fd_waiters(fd_state_t *state, int direction, int revents) {
+	fd_waiter_t *waiter = state->waiters[direction];
+	if (waiter == NULL) return FALSE;
+	
+	state->waiters[direction] = NULL;
+	while (waiter != NULL) {
+		// Once it's ready the waiter may return and take its stack frame with it
+		fd_waiter_t *next = waiter->next[direction];
+		int other = (direction == FD_IN) ? EPOLLOUT : EPOLLIN;
+		if (waiter->events & other) unlink_fd_waiter(state, waiter, !direction);
+		
+		waiter->revents = revents & (waiter->events | EPOLLERR | EPOLLHUP);
+		make_ready(waiter->thread);
+		waiter = next;
+	}
+	return TRUE;
+}
+
+/// Take events from epoll and wake the threads waiting for them
+///
+/// Expects interrupts blocked, timeout as in epoll_wait
+static void poll_io(const struct timespec *timeout) {
+	struct epoll_event events[POLL_EVENTS];
+	int count = epoll_pwait2(poll_fd, events, POLL_EVENTS, timeout, NULL);
+	if (count < 0 && errno == ENOSYS) {
+		// Before Linux 5.11, round up to milliseconds so we never wake early
+		int ms = (timeout == NULL) ? -1 : timeout->tv_sec * 1000 + (timeout->tv_nsec + 999999) / 1000000;
+		count = epoll_wait(poll_fd, events, POLL_EVENTS, ms);
+	}
+	
+	for (int i = 0; i < count; ++i) {
+		fd_state_t *state = events[i].data.ptr;
+		int revents = events[i].events;
+		
+		if (state == NULL) {
+			eventfd_t value;
+			eventfd_read(wake_fd, &value);
+			continue;
+		}
+		
+		if (state == (fd_state_t *)&ring) {
+			reap_ring();
+			continue;
+		}
+		
+		// Errors and hang ups concern both sides
+		int in = revents & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP);
+		int out = revents & (EPOLLOUT | EPOLLERR | EPOLLHUP);
+		
+		spin_lock(&state->lock);
+		if (in && !wake_fd_waiters(state, FD_IN, revents)) state->ready |= EPOLLIN;
+		if (out && !wake_fd_waiters(state, FD_OUT, revents)) state->ready |= EPOLLOUT;
+		spin_unlock(&state->lock);
+	}
+}
+
+/// Map the io_uring queues, FALSE if the kernel won't give us a ring
+static int setup_ring() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	
+	int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if (fd < 0) return FALSE;
+	
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	int single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single && cq_size > sq_size) sq_size = cq_size;
+	
+	char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	char *cq = single ? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+		close(fd);	// unmaps whatever did succeed
+		return FALSE;
+	}
+	
+	ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+	ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	ring.sqes = sqes;
+	ring.cq_entries = params.cq_entries;
+	ring.fd = fd;
+	
+	// Completions make the ring readable, so the idle poller wakes for them
+	struct epoll_event event = {0};
+	event.events = EPOLLIN;
+	event.data.ptr = &ring;
+	epoll_ctl(poll_fd, EPOLL_CTL_ADD, fd, &event);
+	
+	return TRUE;
+}
+
+/// Tell the kernel about the queued submissions
+///
+/// Expects the ring locked
+static void flush_ring() {
+	if (ring.queued == 0) return;
+	
+	int submitted = syscall(__NR_io_uring_enter, ring.fd, ring.queued, 0, 0, NULL, 0);
+	if (submitted > 0) {
+		ring.queued -= submitted;
+		ring.inflight += submitted;
+	}
+}
+
+/// Queue a request on the ring, FALSE if it's too busy to take it
+///
+/// The submission is only flushed right away if asked to or enough have queued up,
+/// otherwise the next tick or idle worker does it along with whatever else queues up until then
+static int submit_ring(io_request_t *request, int flush) {
+	spin_lock(&ring.lock);
+	
+	// More than that in flight and completions could overflow
+	if (ring.inflight + ring.queued >= ring.cq_entries) {
+		spin_unlock(&ring.lock);
+		return FALSE;
+	}
+	
+	unsigned tail = *ring.sq_tail;
+	unsigned index = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[index];
+	
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = request->opcode;
+	sqe->fd = request->fd;
+	sqe->off = request->offset;
+	sqe->user_data = (uintptr_t)request;
+	if (request->opcode != IORING_OP_FSYNC) {
+		sqe->addr = (uintptr_t)&request->iov;
+		sqe->len = 1;
+	}
+	
+	ring.sq_array[index] = index;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring.queued++;
+	
+	if (flush || ring.queued >= RING_BATCH) flush_ring();
+	spin_unlock(&ring.lock);
+	
+	return TRUE;
+}
+
+/// Make every thread with a completed request ready
+static void reap_ring() {
+	if (!spin_trylock(&ring.lock)) return;	// somebody else is at it
+	
+	unsigned head = *ring.cq_head;
+	unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+		io_request_t *request = (io_request_t *)(uintptr_t)cqe->user_data;
+		request->result = cqe->res;
+		make_ready(request->thread);
+		
+		head++;
+		ring.inflight--;
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	
+	spin_unlock(&ring.lock);
+}
+
+/// Flush queued submissions and reap completions, so nothing waits on a worker that's busy or going to sleep
+static void service_ring() {
+	if (ring.queued > 0) {
+		spin_lock(&ring.lock);
+		flush_ring();
+		spin_unlock(&ring.lock);
+	}
+	
+	if (ring.inflight > 0) reap_ring();
+}
+
+/// Run a request on the calling OS thread
+static void run_request(io_request_t *request) {
+	if (request->func != NULL) {
+		request->value = request->func(request->arg);
+		return;
+	}
+	
+	ssize_t result;
+	switch (request->opcode) {
+	case IORING_OP_READV:
+		result = pread(request->fd, request->iov.iov_base, request->iov.iov_len, request->offset);
+		break;
+	case IORING_OP_WRITEV:
+		result = pwrite(request->fd, request->iov.iov_base, request->iov.iov_len, request->offset);
+		break;
+	default:
+		result = fsync(request->fd);
+		break;
+	}
+	
+	request->result = (result < 0) ? -errno : result;
+}
+
+static void *helper_thread(void *arg) {
+	// The timer is meant for workers
+	sigset_t timer;
+	sigemptyset(&timer);
+	sigaddset(&timer, SIGVTALRM);
+	pthread_sigmask(SIG_BLOCK, &timer, NULL);
+	
+	pthread_mutex_lock(&helpers_lock);
+	while (1) {
+		helpers_idle++;
+		while (helper_front == NULL) pthread_cond_wait(&helpers_cond, &helpers_lock);
+		helpers_idle--;
+		
+		io_request_t *request = helper_front;
+		helper_front = request->next;
+		if (helper_front == NULL) helper_back = NULL;
+		helper_stats.queued--;
+		pthread_mutex_unlock(&helpers_lock);
+		
+		run_request(request);
+		
+		// Counted before it's posted, so a caller reading the stats right after sees its own call
+		unsigned long latency = monotonic_ns() - request->submitted;
+		pthread_mutex_lock(&helpers_lock);
+		helper_stats.calls++;
+		helper_stats.latency_ns += latency;
+		if (latency > helper_stats.max_latency_ns) helper_stats.max_latency_ns = latency;
+		
+		// Once posted the request is gone, the thread might already be running
+		post_ready(request->thread);
+	}
+	
+	return arg;
+}
+
+/// Hand a request to the helper threads
+///
+/// Helpers are started as they're needed, up to HELPER_THREADS
+static void submit_helpers(io_request_t *request) {
+	request->next = NULL;
+	
+	pthread_mutex_lock(&helpers_lock);
+	if (helper_back != NULL) {
+		helper_back->next = request;
+	} else {
+		helper_front = request;
+	}
+	helper_back = request;
+	
+	helper_stats.queued++;
+	if (helper_stats.queued > helper_stats.max_queued) helper_stats.max_queued = helper_stats.queued;
+	
+	if (helpers_idle < helper_stats.queued && helpers_started < HELPER_THREADS) {
+		pthread_t helper;
+		if (pthread_create(&helper, NULL, helper_thread, NULL) == 0) {
+			pthread_detach(helper);
+			helpers_started++;
+		}
+	}
+	
+	// Nobody to run it at all, better block the worker than lose the thread
+	if (helpers_started == 0) {
+		helper_front = helper_back = NULL;
+		helper_stats.queued--;
+		pthread_mutex_unlock(&helpers_lock);
+		run_request(request);
+		post_ready(request->thread);
+		return;
+	}
+	
+	pthread_cond_signal(&helpers_cond);
+	pthread_mutex_unlock(&helpers_lock);
+}
+
+/// Pick io_uring if we can, fall back to the helper threads otherwise
+///
+/// Expects interrupts blocked
+static void setup_io() {
+	spin_lock(&io_backend_lock);
+	if (io_backend == IO_UNKNOWN) io_backend = (IO_URING && setup_ring()) ? IO_RING : IO_HELPERS;
+	spin_unlock(&io_backend_lock);
+}
+
+/// Start a request the previous thread parked on
+static void submit_io(worker_t *worker, io_request_t *request) {
+	// Only flush straight away if there's nothing else to run that might queue more
+	if (request->func == NULL && io_backend == IO_RING && submit_ring(request, worker->count == 0)) return;
+	
+	request->submitted = monotonic_ns();
+	submit_helpers(request);
+}
+
+static inline int timer_before(unsigned a, unsigned b) {
+	return timers[a]->deadline < timers[b]->deadline;
+}
+
+static inline void timer_swap(unsigned a, unsigned b) {
+	sleeper_t *sleeper = timers[a];
+	timers[a] = timers[b];
+	timers[b] = sleeper;
+	timers[a]->index = a;
+	timers[b]->index = b;
+}
+
+/// Restore the heap order around a sleeper that moved, expects the timers locked
+static void timer_fix(unsigned index) {
+	while (index > 0 && timer_before(index, (index - 1) / 2)) {
+		timer_swap(index, (index - 1) / 2);
+		index = (index - 1) / 2;
+	}
+	
+	while (1) {
+		unsigned smallest = index;
+		unsigned left = 2 * index + 1, right = left + 1;
+		if (left < timer_count && timer_before(left, smallest)) smallest = left;
+		if (right < timer_count && timer_before(right, smallest)) smallest = right;
+		if (smallest == index) break;
+		
+		timer_swap(index, smallest);
+		index = smallest;
+	}
+	
+	next_deadline = (timer_count > 0) ? timers[0]->deadline : ULONG_MAX;
+}
+
+/// Add a sleeper to the heap, expects the timers locked
+static void add_timer(sleeper_t *sleeper) {
+	if (timer_count == timer_capacity) {
+		timer_capacity = timer_capacity ? timer_capacity * 2 : 64;
+		timers = realloc(timers, timer_capacity * sizeof(sleeper_t *));
+		assert(timers != NULL);
+	}
+	
+	unsigned long earliest = next_deadline;
+	sleeper->index = timer_count;
+	timers[timer_count++] = sleeper;
+	timer_fix(sleeper->index);
+	
+	// An idle worker might be sleeping until a later deadline, or none at all
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (sleeper->deadline < earliest && __atomic_load_n(&polling, __ATOMIC_RELAXED)) eventfd_write(wake_fd, 1);
+}
+
+/// Take a sleeper off the heap, expects the timers locked
+static void remove_timer(sleeper_t *sleeper) {
+	unsigned index = sleeper->index;
+	sleeper->index = NOT_QUEUED;
+	timer_count--;
+	if (index != timer_count) {
+		timers[index] = timers[timer_count];
+		timers[index]->index = index;
+		timer_fix(index);
+	} else {
+		next_deadline = (timer_count > 0) ? timers[0]->deadline : ULONG_MAX;
+	}
+}
+
+/// Make every sleeper whose deadline has passed ready
+///
+/// The waits are set up locking the wait queue and then the timers, so here the queue is only tried
+/// A busy one is left on the heap for the next call, the deadline has passed so that's soon
+/// Its lock may live in the structure waited on, a joined green_t say, which is only sure
+/// to be around while the sleeper is still on its queue, so it's never touched once the sleeper is off
+static void expire_timers() {
+	if (next_deadline > monotonic_ns()) return;
+	if (!spin_trylock(&timers_lock)) return;	// somebody else is at it
+	
+	sleeper_t *expired = NULL;
+	unsigned long now = monotonic_ns();
+	while (timer_count > 0 && timers[0]->deadline <= now) {
+		sleeper_t *sleeper = timers[0];
+		if (sleeper->lock == NULL) {
+			remove_timer(sleeper);
+			make_ready(sleeper->thread);
+			continue;
+		}
+		
+		if (!spin_trylock(sleeper->lock)) break;
+		remove_timer(sleeper);
+		
+		// Still pending means still queued, the queue is locked so nobody wakes it meanwhile
+		if (__atomic_compare_exchange_n(&sleeper->state, &(int){WAIT_PENDING}, WAIT_EXPIRED,
+			FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			remove_queue(sleeper->queue, sleeper->thread);
+			sleeper->queue = NULL;
+			sleeper->next = expired;
+			expired = sleeper;
+		}
+		// Otherwise it was just woken, the waker makes it ready
+		spin_unlock(sleeper->lock);
+	}
+	
+	spin_unlock(&timers_lock);
+	
+	// Only we make these ready, so they stay put until then
+	while (expired != NULL) {
+		sleeper_t *sleeper = expired;
+		expired = sleeper->next;
+		make_ready(sleeper->thread);
+	}
+}
+
+/// Take the first waiter off a wait queue, skipping the ones whose deadline already claimed them
+///
+/// Expects the queue locked, hand the result to wake_waiter() after unlocking
+static green_t *pop_waiter(green_queue_t *queue) {
+	while (queue->front != NULL) {
+		green_t *thread = pop_queue(queue);
+		sleeper_t *sleeper = thread->timeout;
+		if (sleeper == NULL) return thread;
+		
+		sleeper->queue = NULL;
+		if (__atomic_compare_exchange_n(&sleeper->state, &(int){WAIT_PENDING}, WAIT_WOKEN,
+			FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			return thread;
+		}
+	}
+	
+	return NULL;
+}
+
+/// Take the deadline of a waiter from pop_waiter() off the heap, if it has one
+static void cancel_deadline(green_t *thread) {
+	sleeper_t *sleeper = thread->timeout;
+	if (sleeper == NULL) return;
+	
+	spin_lock(&timers_lock);
+	if (sleeper->index != NOT_QUEUED) remove_timer(sleeper);
+	spin_unlock(&timers_lock);
+	
+	// Settled, whatever queue it goes on next it's an ordinary waiter there
+	thread->timeout = NULL;
+}
+
+/// Make a waiter from pop_waiter() ready, cancelling its deadline if it has one
+static void wake_waiter(green_t *thread) {
+	cancel_deadline(thread);
+	make_ready(thread);
+}
+
+/// Park the running thread on a wait queue until it's woken or the deadline passes
+///
+/// Expects the queue locked with the thread pushed on it, the lock is released once we're parked
+/// Returns TRUE if the deadline passed first, the thread is off the queue either way
+static int schedule_until(green_queue_t *queue, int *lock, unsigned long deadline) {
+	green_t *thread = current_worker()->running;
+	
+	sleeper_t sleeper;
+	sleeper.thread = thread;
+	sleeper.deadline = deadline;
+	sleeper.state = WAIT_PENDING;
+	sleeper.queue = queue;
+	sleeper.lock = lock;
+	thread->timeout = &sleeper;
+	
+	spin_lock(&timers_lock);
+	add_timer(&sleeper);
+	spin_unlock(&timers_lock);
+	
+	schedule(lock);
+	thread->timeout = NULL;
+	
+	return sleeper.state == WAIT_EXPIRED;
+}
+
+static inline unsigned long timespec_ns(const struct timespec *time) {
+	return (time->tv_sec > 0) ? time->tv_sec * 1000000000UL + time->tv_nsec : 0;
+}
+
+/// Sleep until some worker has pushed new work
+///
+/// If threads wait on fds, one idle worker sleeps in epoll_wait instead
+static void idle_wait() {
+	if (tickless) stop_ticks(current_worker());
+	
+	int seq = __atomic_load_n(&idle_seq, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+	
+	if (ring.fd >= 0) service_ring();
+	if (timer_count > 0) expire_timers();
+	
+	int found = __atomic_load_n(&inbox, __ATOMIC_SEQ_CST) != NULL || __atomic_load_n(&posted_signals, __ATOMIC_SEQ_CST) != NULL;
+	int count = __atomic_load_n(&worker_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < count && !found; ++i) {
+		found = __atomic_load_n(&workers[i].count, __ATOMIC_RELAXED) > 0;
+	}
+	
+	if (!found) {
+		int waiting = __atomic_load_n(&io_waiters, __ATOMIC_RELAXED) > 0 || __atomic_load_n(&timer_count, __ATOMIC_RELAXED) > 0;
+		if (waiting && !__atomic_exchange_n(&polling, TRUE, __ATOMIC_SEQ_CST)) {
+			// One idle worker waits on both fds and the earliest deadline, read after claiming the poll
+			// so add_timer() either sees us polling or we see its deadline
+			struct timespec timeout, *wait = NULL;
+			unsigned long deadline = next_deadline;
+			if (deadline != ULONG_MAX) {
+				unsigned long now = monotonic_ns();
+				unsigned long left = (deadline > now) ? deadline - now : 0;
+				timeout.tv_sec = left / 1000000000;
+				timeout.tv_nsec = left % 1000000000;
+				wait = &timeout;
+			}
+			
+			poll_io(wait);
+			__atomic_store_n(&polling, FALSE, __ATOMIC_SEQ_CST);
+			if (timer_count > 0) expire_timers();
+		} else {
+			futex(&idle_seq, FUTEX_WAIT_PRIVATE, seq);
+		}
+	}
+	
+	__atomic_sub_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void drain_signals();
+
+/// The scheduler loop of a worker, runs with interrupts blocked
+static void idle_loop(worker_t *worker) {
+	while (1) {
+		finish_switch();
+		
+		green_t *next;
+		while (drain_signals(), (next = next_ready(worker, GREEN_PRIORITY_BATCH)) == NULL) {
+			idle_wait();
+		}
+		
+		preempt_pending = FALSE;	// a tick that came while idling is no reason to preempt the thread
+		worker->running = next;
+		worker->switches++;
+		worker->slice_start = read_cycles();
+		context_switch(&worker->idle.context, &next->context);
+	}
+}
+
+static void idle_entry() {
+	idle_loop(current_worker());
+}
+
+static void *worker_thread(void *arg) {
+	worker_t *worker = (worker_t *)arg;
+	self = worker;
+	
+	block_interrupts();	// the scheduler loop is one long key area
+	worker->running = &worker->idle;
+	
+	// The process timer already covers us, a clock of our own starts now
+	spin_lock(&ticks_lock);
+	worker->tid = syscall(SYS_gettid);
+#if PREEMPTIVE
+	if (quantum_clock == GREEN_CLOCK_MONOTONIC && make_ticker(worker) == 0) set_ticks(worker, TRUE);
+#endif // PREEMPTIVE
+	spin_unlock(&ticks_lock);
+	
+	idle_loop(worker);
+	
+	return NULL;
+}
+
+int green_set_concurrency(int count) {
+	if (count < 1 || count > MAX_WORKERS) return -1;
+	
+	spin_lock(&workers_lock);
+	if (count > 1) __atomic_store_n(&concurrent, TRUE, __ATOMIC_SEQ_CST);
+	
+	for (int i = worker_count; i < count; ++i) {
+		worker_t *worker = &workers[i];
+		for (int class = 0; class < PRIORITIES; ++class) init_queue(&worker->ready[class]);
+		worker->seed = i;
+		
+		if (pthread_create(&worker->pthread, NULL, worker_thread, worker) != 0) {
+			spin_unlock(&workers_lock);
+			return -1;
+		}
+		
+		// Only publish the worker once it's set up, thieves walk up to worker_count
+		__atomic_store_n(&worker_count, i + 1, __ATOMIC_RELEASE);
+	}
+	spin_unlock(&workers_lock);
+	
+	return 0;
+}
+
+/// Hand the thread's leftover specific values to their key destructors
+///
+/// Runs as the exiting thread with interrupts on, destructors are user code and may block
+static void run_key_destructors(green_t *thread) {
+	unsigned int count = __atomic_load_n(&key_count, __ATOMIC_ACQUIRE);
+	
+	for (int pass = 0; pass < KEY_PASSES; ++pass) {
+		int called = FALSE;
+		for (unsigned int key = 0; key < count; ++key) {
+			void **slot = (key < GREEN_KEYS_INLINE) ? &thread->specific[key]
+				: (thread->specific_more != NULL) ? &thread->specific_more[key - GREEN_KEYS_INLINE] : NULL;
+			if (slot == NULL || *slot == NULL || key_destructors[key] == NULL) continue;
+			
+			void *value = *slot;
+			*slot = NULL;
+			key_destructors[key](value);
+			called = TRUE;
+		}
+		if (!called) break;
+	}
+	
+	block_interrupts();
+	free(thread->specific_more);
+	thread->specific_more = NULL;
+	unblock_interrupts();
+}
+
+void green_thread() {
+	// Like every switch, the one that got us here had interrupts blocked
+	green_t *this = current_worker()->running;
+	finish_switch();
+	unblock_interrupts();
+	
+	this->result = (*this->func)(this->arg);	// execute user function
+	run_key_destructors(this);
+	
+	// We are in key area, so make sure not to corrupt any queues
+	block_interrupts();
+	worker_t *worker = current_worker();
+	
+	if (this->stack_profiled) {
+		this->stack_peak = measure_stack(this->stack, this->stack_size);
+		record_stack_peak(this->func, this->stack_peak);
+	}
+	
+	spin_lock(&this->lock);
+	green_queue_t joiners;
+	init_queue(&joiners);
+	green_t *joiner;
+	while ((joiner = pop_waiter(&this->join)) != NULL) push_queue(&joiners, joiner);
+	
+	// Groups not woken by this exit may return the moment we unlock, their watches must not be touched after
+	join_group_t *groups = NULL;
+	for (join_watch_t *watch = this->watchers, *next; watch != NULL; watch = next) {
+		next = watch->next;
+		watch->linked = FALSE;
+		
+		join_group_t *group = watch->group;
+		if (__atomic_sub_fetch(&group->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+			group->first = watch->index;
+			group->wake_next = groups;
+			groups = group;
+		}
+	}
+	this->watchers = NULL;
+	
+	// We are still running on the stack, so let whoever runs next free it
+	worker->retire = this->stack;
+	worker->retire_size = this->stack_size;
+	if (this->pooled) worker->reclaim = this;	// nobody else knows about it, so nobody looks at it again
+	
+	// this thread is now a zombie, the joiner is free to reuse the structure after the unlock
+	this->zombie = TRUE;
+	spin_unlock(&this->lock);
+	
+	// Place waiting threads to the ready queue
+	while (joiners.front != NULL) wake_waiter(pop_queue(&joiners));
+	while (groups != NULL) {
+		join_group_t *group = groups;
+		groups = group->wake_next;
+		
+		spin_lock(&group->lock);	// it might still be watching its other threads
+		spin_unlock(&group->lock);
+		make_ready(group->thread);
+	}
+	
+	green_t *next = next_ready(worker, GREEN_PRIORITY_BATCH);
+	preempt_pending = FALSE;	// a joiner of a higher class asked for a switch, this is it
+	worker->running = (next != NULL) ? next : &worker->idle;
+	worker->switches++;
+	worker->slice_start = read_cycles();
+	context_load(&worker->running->context);
+}
+
+void green_attr_init(green_attr_t *attr) {
+	attr->stack_size = STACK_SIZE;
+	attr->priority = GREEN_PRIORITY_NORMAL;
+}
+
+int green_attr_setstacksize(green_attr_t *attr, size_t size) {
+	attr->stack_size = size;
+	return 0;
+}
+
+int green_attr_setpriority(green_attr_t *attr, enum green_priority priority) {
+	if (priority < GREEN_PRIORITY_INTERACTIVE || priority > GREEN_PRIORITY_BATCH) return -1;
+	
+	attr->priority = priority;
+	return 0;
+}
+
+int green_create(green_t *new, void *(*func)(void *), void *arg) {
+	return green_create_attr(new, NULL, func, arg);
+}
+
+/// Set up a thread on a structure and make it runnable, pooled ones are detached and come from get_thread()
+static int create_thread(green_t *new, const green_attr_t *attr, void *(*func)(void *), void *arg, int pooled) {
+	size_t size = (attr != NULL) ? attr->stack_size : STACK_SIZE;
+	if (size == GREEN_STACK_AUTO) {
+		size_t peak = green_stack_peak(func);
+		size = (peak != 0) ? peak + peak / 4 + STACK_HEADROOM : STACK_SIZE;
+	}
+	size = stack_size_for(size);
+	
+	block_interrupts();
+	void *stack = get_stack(current_worker(), size);
+	if (stack == NULL) {
+		unblock_interrupts();
+		return -1;
+	}
+	
+	// Initialize the thread structure
+	new->stack = stack;
+	new->stack_size = size;
+	new->stack_peak = 0;
+	new->stack_profiled = profiling;
+	new->func = func;
+	new->arg = arg;
+	new->result = NULL;
+	new->next = NULL;
+	new->prev = NULL;
+	new->ready_on = NOT_READY;
+	new->priority = (attr != NULL) ? attr->priority : GREEN_PRIORITY_NORMAL;
+	init_queue(&new->join);
+	new->timeout = NULL;
+	new->watchers = NULL;
+	new->park_state = PARK_NONE;
+	for (int key = 0; key < GREEN_KEYS_INLINE; ++key) new->specific[key] = NULL;
+	new->specific_more = NULL;	// the rest are only allocated by green_setspecific()
+	new->zombie = FALSE;
+	new->detached = pooled;
+	new->pooled = pooled;
+	new->lock = FALSE;
+	
+	if (new->stack_profiled) {
+		for (uint64_t *word = stack; word < (uint64_t *)((char *)stack + size); ++word) {
+			*word = STACK_PATTERN;
+		}
+	}
+	
+	context_make(&new->context, stack, size, green_thread);
+	
+	worker_t *worker = current_worker();
+	preempt_for(worker, new->priority);
+	push_ready(worker, new);
+	unblock_interrupts();
+	
+	return 0;
+}
+
+int green_key_create(green_key_t *key, void (*destructor)(void *)) {
+	block_interrupts();
+	spin_lock(&keys_lock);
+	if (key_count == KEYS_MAX) {
+		spin_unlock(&keys_lock);
+		unblock_interrupts();
+		return -1;
+	}
+	
+	key_destructors[key_count] = destructor;
+	*key = key_count;
+	__atomic_store_n(&key_count, key_count + 1, __ATOMIC_RELEASE);	// exiting threads see the destructor with the key
+	spin_unlock(&keys_lock);
+	unblock_interrupts();
+	
+	return 0;
+}
+
+void *green_getspecific(green_key_t key) {
+	// Interrupts stay blocked so the thread can't move to another worker between the two loads
+	block_interrupts();
+	green_t *thread = current_worker()->running;
+	void *value = (key < GREEN_KEYS_INLINE) ? thread->specific[key]
+		: (thread->specific_more != NULL && key < KEYS_MAX) ? thread->specific_more[key - GREEN_KEYS_INLINE] : NULL;
+	unblock_interrupts();
+	
+	return value;
+}
+
+int green_setspecific(green_key_t key, const void *value) {
+	if (key >= __atomic_load_n(&key_count, __ATOMIC_RELAXED)) return -1;
+	
+	block_interrupts();
+	green_t *thread = current_worker()->running;
+	if (key < GREEN_KEYS_INLINE) {
+		thread->specific[key] = (void *)value;
+	} else {
+		if (thread->specific_more == NULL) {
+			thread->specific_more = calloc(KEYS_MAX - GREEN_KEYS_INLINE, sizeof(void *));
+			if (thread->specific_more == NULL) {
+				unblock_interrupts();
+				return -1;
+			}
+		}
+		thread->specific_more[key - GREEN_KEYS_INLINE] = (void *)value;
+	}
+	unblock_interrupts();
+	
+	return 0;
+}
+
+int green_create_attr(green_t *new, const green_attr_t *attr, void *(*func)(void *), void *arg) {
+	return create_thread(new, attr, func, arg, FALSE);
+}
+
+int green_create_detached(const green_attr_t *attr, void *(*func)(void *), void *arg) {
+	block_interrupts();
+	green_t *new = get_thread(current_worker());
+	if (new == NULL || create_thread(new, attr, func, arg, TRUE) != 0) {
+		if (new != NULL) put_thread(current_worker(), new);
+		unblock_interrupts();
+		return -1;
+	}
+	unblock_interrupts();
+	
+	return 0;
+}
+
+green_t *green_self() {
+	block_interrupts();
+	green_t *thread = current_worker()->running;
+	unblock_interrupts();
+	
+	return thread;
+}
+
+void green_park() {
+	block_interrupts();
+	worker_t *worker = current_worker();
+	green_t *thread = worker->running;
+	
+	// A wake that came first is used up instead of parking
+	if (!__atomic_compare_exchange_n(&thread->park_state, &(int){PARK_PERMIT}, PARK_NONE,
+		FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		worker->park = thread;
+		schedule(NULL);
+	}
+	unblock_interrupts();
+}
+
+void green_wake(green_t *thread) {
+	int state = __atomic_load_n(&thread->park_state, __ATOMIC_ACQUIRE);
+	while (TRUE) {
+		if (state == PARK_PERMIT) return;
+		
+		// A parked thread is off its stack, whoever takes it off PARK_PARKED posts it
+		int target = (state == PARK_PARKED) ? PARK_NONE : PARK_PERMIT;
+		if (__atomic_compare_exchange_n(&thread->park_state, &state, target, TRUE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) break;
+	}
+	
+	if (state == PARK_PARKED) post_ready(thread);
+}
+
+int green_detach(green_t *thread) {
+	block_interrupts();
+	spin_lock(&thread->lock);
+	int detached = thread->detached;
+	thread->detached = TRUE;
+	spin_unlock(&thread->lock);
+	unblock_interrupts();
+	
+	return detached ? -1 : 0;
+}
+
+/// Flush the ring, wake expired sleepers and check on fds, without blocking
+static void poll_events() {
+	static const struct timespec now = {0, 0};
+	
+	if (ring.fd >= 0) service_ring();
+	if (timer_count > 0) expire_timers();
+	if (__atomic_load_n(&io_waiters, __ATOMIC_RELAXED) > 0) poll_io(&now);
+}
+
+/// green_yield without touching interrupts
+///
+/// No locks are held here, so it's also where signals posted from other OS threads are carried out
+static void yield() {
+	drain_signals();
+	
+	worker_t *worker = current_worker();
+	green_t *suspended = worker->running;
+
+	// Nothing ticks in a cooperative build or with a quantum of 0, so a busy worker polls here instead,
+	// as often as the timer would, or the default period would without one
+	if (!PREEMPTIVE || quantum == 0) {
+		unsigned long every = (slice_cycles != 0) ? slice_cycles : period_cycles;
+		if (read_cycles() - worker->polled_at >= every) {
+			worker->polled_at = read_cycles();
+			poll_events();
+		}
+	}
+
+	// Nothing else worth running, so don't bother switching
+	green_t *next = next_ready(worker, suspended->priority);
+	if (next != NULL) {
+		worker->requeue = suspended;
+		switch_to(worker, suspended, next);
+	}
+}
+
+/// A timer tick, check on fds then let the next thread run
+static void tick() {
+	poll_events();
+	
+	worker_t *worker = current_worker();
+	if (tickless && !wants_ticks(worker)) stop_ticks(worker);
+	yield();
+}
+
+/// Take the switch the timer postponed, while still in the key area
+static void preempt() {
+	while (preempt_pending) {
+		int reason = preempt_pending;
+		preempt_pending = FALSE;
+		if (reason == PREEMPT_WAKEUP) {
+			yield();
+		} else {
+			tick();
+		}
+	}
+}
+
+int green_yield() {
+	block_interrupts();
+	yield();
+	unblock_interrupts();
+	
+	return 0;
+}
+
+void green_maybe_yield() {
+	// Two loads and a counter read while the slice lasts, cheap enough for every iteration of a hot loop
+	if (!preempt_pending && (slice_cycles == 0 || read_cycles() - current_worker()->slice_start < slice_cycles)) return;
+	
+	block_interrupts();
+	if (!preempt_pending) preempt_pending = TRUE;	// the slice is up, same as a timer tick
+	preempt();
+	current_worker()->slice_start = read_cycles();	// a yield that found nobody else still starts a new slice
+	unblock_interrupts();
+}
+
+int green_set_priority(enum green_priority priority) {
+	if (priority < GREEN_PRIORITY_INTERACTIVE || priority > GREEN_PRIORITY_BATCH) return -1;
+	
+	// Nothing else looks at it while the thread runs, it counts from the next time it's queued
+	block_interrupts();
+	worker_t *worker = current_worker();
+	enum green_priority old = worker->running->priority;
+	worker->running->priority = priority;
+	
+	// Dropping below what is already runnable gives the worker away right here
+	if (priority > old) yield();
+	unblock_interrupts();
+	
+	return 0;
+}
+
+#if PREEMPTIVE
+int green_set_quantum(unsigned long ns, enum green_clock clock) {
+	if (clock != GREEN_CLOCK_CPU && clock != GREEN_CLOCK_MONOTONIC) return -1;
+	
+	block_interrupts();
+	spin_lock(&ticks_lock);
+	
+	// Workers still starting make their own timer, they only have a tid once running
+	int count = __atomic_load_n(&worker_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < count && clock == GREEN_CLOCK_MONOTONIC; ++i) {
+		if (workers[i].tid != 0 && make_ticker(&workers[i]) != 0) {
+			spin_unlock(&ticks_lock);
+			unblock_interrupts();
+			return -1;
+		}
+	}
+	
+	// Stop the old clock before the new one starts, tickless mode stops the new one where it's not needed
+	for (int i = 0; i < count; ++i) {
+		set_ticks(&workers[i], FALSE);
+		if (quantum_clock == GREEN_CLOCK_CPU) break;
+	}
+	quantum = ns;
+	quantum_clock = clock;
+	slice_cycles = ns * cycles_per_ns;
+	start_all_ticks();
+	
+	spin_unlock(&ticks_lock);
+	unblock_interrupts();
+	
+	return 0;
+}
+
+void green_set_tickless(int enable) {
+	block_interrupts();
+	spin_lock(&ticks_lock);
+	tickless = enable;
+	if (!enable) start_all_ticks();
+	spin_unlock(&ticks_lock);
+	unblock_interrupts();
+}
+#else
+// Without a timer the quantum only sizes the green_maybe_yield() slice
+int green_set_quantum(unsigned long ns, enum green_clock clock) {
+	if (clock != GREEN_CLOCK_CPU && clock != GREEN_CLOCK_MONOTONIC) return -1;
+	
+	quantum = ns;
+	quantum_clock = clock;
+	__atomic_store_n(&slice_cycles, (unsigned long)(ns * cycles_per_ns), __ATOMIC_RELAXED);
+	return 0;
+}
+
+void green_set_tickless(int enable) {
+	tickless = enable;	// nothing ticks anyway
+}
+#endif // PREEMPTIVE
+
+int green_set_policy(enum green_sched_policy new_policy) {
+	if (new_policy < GREEN_SCHED_FIFO || new_policy > GREEN_SCHED_RANDOM) return -1;
+	
+	__atomic_store_n(&policy, new_policy, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int green_yield_to(green_t *thread) {
+	block_interrupts();
+	worker_t *worker = current_worker();
+	green_t *suspended = worker->running;
+	
+	// Take it off whichever run queue it's on, it might be taken by someone else meanwhile
+	int found = FALSE;
+	int on = __atomic_load_n(&thread->ready_on, __ATOMIC_RELAXED);
+	if (on != NOT_READY) {
+		worker_t *owner = &workers[on];
+		spin_lock(&owner->lock);
+		if (thread->ready_on == on) {
+			remove_queue(&owner->ready[thread->priority], thread);
+			thread->ready_on = NOT_READY;
+			owner->count--;
+			found = TRUE;
+		}
+		spin_unlock(&owner->lock);
+	}
+	
+	// The timer isn't touched, the thread gets whatever is left of the quantum like after any switch
+	if (found) {
+		worker->requeue = suspended;
+		switch_to(worker, suspended, thread);
+	} else {
+		yield();
+	}
+	unblock_interrupts();
+	
+	return found ? 0 : -1;
+}
+
+/// Wait for a zombie's exit to drop its lock, the structure is only free for reuse after that
+static inline void await_unlock(green_t *thread) {
+	while (__atomic_load_n(&thread->lock, __ATOMIC_ACQUIRE)) cpu_relax();
+}
+
+int green_join(green_t *thread, void **result) {
+	if (thread->detached) return EINVAL;
+	
+	if (thread->zombie) {
+		await_unlock(thread);
+		if (result != NULL) *result = thread->result;
+		return 0;
+	}
+	
+	block_interrupts();
+	spin_lock(&thread->lock);
+	
+	// It might have finished while we were taking the lock
+	if (thread->zombie) {
+		spin_unlock(&thread->lock);
+		unblock_interrupts();
+		if (result != NULL) *result = thread->result;
+		return 0;
+	}
+	
+	push_queue(&thread->join, current_worker()->running);
+	
+	schedule(&thread->lock);
+	unblock_interrupts();
+	
+	if (result != NULL) *result = thread->result;
+	return 0;
+}
+
+int green_join_timeout(green_t *thread, void **result, const struct timespec *deadline) {
+	if (thread->detached) return EINVAL;
+	
+	if (thread->zombie) {
+		await_unlock(thread);
+		if (result != NULL) *result = thread->result;
+		return 0;
+	}
+	
+	block_interrupts();
+	spin_lock(&thread->lock);
+	
+	if (thread->zombie) {
+		spin_unlock(&thread->lock);
+		unblock_interrupts();
+		if (result != NULL) *result = thread->result;
+		return 0;
+	}
+	
+	push_queue(&thread->join, current_worker()->running);
+	
+	int expired = schedule_until(&thread->join, &thread->lock, timespec_ns(deadline));
+	unblock_interrupts();
+	
+	if (expired) return ETIMEDOUT;
+	
+	if (result != NULL) *result = thread->result;
+	return 0;
+}
+
+/// Wait on a join group over count threads, remaining is 1 to wake on any exit or count for all of them
+///
+/// Threads found finished count down right here, whoever takes remaining to 0 is the one
+/// that completes the group, so the caller either returns without parking or is woken exactly once
+/// Returns the index of the thread that completed the group, -1 if the watches can't be allocated
+static int join_group(green_t **threads, int count, int remaining) {
+	join_group_t group;
+	group.remaining = remaining;
+	group.first = -1;
+	group.lock = FALSE;
+	
+	// Thread stacks are small, a large group would run off the guard page
+	join_watch_t inline_watches[JOIN_INLINE];
+	join_watch_t *watches = inline_watches;
+	
+	block_interrupts();
+	if (count > JOIN_INLINE) {
+		watches = malloc(count * sizeof(join_watch_t));
+		if (watches == NULL) {
+			unblock_interrupts();
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	
+	group.thread = current_worker()->running;
+	spin_lock(&group.lock);
+	
+	int completed = FALSE;
+	for (int i = 0; i < count; ++i) {
+		green_t *thread = threads[i];
+		watches[i].linked = FALSE;
+		watches[i].watched = FALSE;
+		
+		spin_lock(&thread->lock);
+		if (!thread->zombie) {
+			watches[i].group = &group;
+			watches[i].index = i;
+			watches[i].linked = TRUE;
+			watches[i].watched = TRUE;
+			watches[i].prev = NULL;
+			watches[i].next = thread->watchers;
+			if (thread->watchers != NULL) ((join_watch_t *)thread->watchers)->prev = &watches[i];
+			thread->watchers = &watches[i];
+			spin_unlock(&thread->lock);
+			continue;
+		}
+		spin_unlock(&thread->lock);
+		
+		int left = __atomic_sub_fetch(&group.remaining, 1, __ATOMIC_ACQ_REL);
+		if (left == 0) {
+			group.first = i;
+			completed = TRUE;
+		}
+		
+		// Either way the group is done, if an exit got there first its wakeup is on the way
+		if (left <= 0) {
+			for (int j = i + 1; j < count; ++j) watches[j].linked = watches[j].watched = FALSE;
+			break;
+		}
+	}
+	
+	if (completed) {
+		spin_unlock(&group.lock);
+	} else {
+		schedule(&group.lock);
+	}
+	
+	// Leftover watches are on threads still running, and a thread that counted the group down
+	// may still be finishing its exit under the lock, so its structure isn't ours to return yet
+	for (int i = 0; i < count; ++i) {
+		if (!watches[i].watched) continue;
+		
+		green_t *thread = threads[i];
+		spin_lock(&thread->lock);
+		if (watches[i].linked) {
+			if (watches[i].prev != NULL) watches[i].prev->next = watches[i].next;
+			else thread->watchers = watches[i].next;
+			if (watches[i].next != NULL) watches[i].next->prev = watches[i].prev;
+		}
+		spin_unlock(&thread->lock);
+	}
+	
+	if (watches != inline_watches) free(watches);
+	unblock_interrupts();
+	
+	return group.first;
+}
+
+/// Whether any of the threads is detached, those can't be joined
+static int any_detached(green_t **threads, int count) {
+	for (int i = 0; i < count; ++i) {
+		if (threads[i]->detached) return TRUE;
+	}
+	
+	return FALSE;
+}
+
+int green_join_any(green_t **threads, int count, void **result) {
+	if (count < 1 || any_detached(threads, count)) {
+		errno = EINVAL;
+		return -1;
+	}
+	
+	int first = join_group(threads, count, 1);
+	if (first >= 0 && result != NULL) *result = threads[first]->result;
+	return first;
+}
+
+int green_join_all(green_t **threads, int count, void **results) {
+	if (count < 1) return 0;
+	
+	if (any_detached(threads, count)) {
+		errno = EINVAL;
+		return -1;
+	}
+	
+	if (join_group(threads, count, count) < 0) return -1;
+	for (int i = 0; results != NULL && i < count; ++i) results[i] = threads[i]->result;
+	return 0;
+}
+
+/// Queue a thread on the mutex, expects the mutex locked
+///
+/// A retry keeps the time waiters started going without the mutex, so barging can't hide starvation
+static void mutex_wait(green_mutex_t *mutex, green_t *thread, int retry) {
+	if (mutex->mode == GREEN_MUTEX_ADAPTIVE && mutex->queue.front == NULL && !retry) {
+		mutex->starving_since = monotonic_ns();
+	}
+	
+	push_queue(&mutex->queue, thread);
+}
+
+/// Whether the mutex is ours to take, expects the mutex locked
+static inline int mutex_free(green_mutex_t *mutex, green_t *thread) {
+	return !mutex->taken || mutex->handoff == thread;
+}
+
+/// Take a free mutex, expects the mutex locked
+static inline void mutex_take(green_mutex_t *mutex, int waited) {
+	mutex->taken = TRUE;
+	mutex->handoff = NULL;
+	
+	// Waiters are making progress
+	if (waited && mutex->mode == GREEN_MUTEX_ADAPTIVE) mutex->starving_since = monotonic_ns();
+}
+
+/// green_mutex_lock without touching interrupts
+static void mutex_acquire(green_mutex_t *mutex) {
+	green_t *running = current_worker()->running;
+	int waited = FALSE;
+	
+	spin_lock(&mutex->lock);
+	while (!mutex_free(mutex, running)) {
+		mutex_wait(mutex, running, waited);
+		
+		schedule(&mutex->lock);
+		waited = TRUE;
+		spin_lock(&mutex->lock);
+	}
+	
+	mutex_take(mutex, waited);
+	spin_unlock(&mutex->lock);
+}
+
+/// green_mutex_unlock without touching interrupts
+///
+/// With direct set, a waiter the mutex is handed to runs right away in place of the caller
+static void mutex_release(green_mutex_t *mutex, int direct) {
+	green_t *waiter = NULL;
+	
+	spin_lock(&mutex->lock);
+	// Move only one thread, as the only way its one of the suspended onces is it's trying to lock mutex
+	waiter = pop_waiter(&mutex->queue);
+	
+	int handoff = waiter != NULL && (mutex->mode == GREEN_MUTEX_HANDOFF ||
+		(mutex->mode == GREEN_MUTEX_ADAPTIVE && monotonic_ns() - mutex->starving_since > MUTEX_STARVE_NS));
+	if (handoff) {
+		mutex->handoff = waiter;	// still taken, nobody else can barge in
+	} else {
+		mutex->taken = FALSE;
+	}
+	spin_unlock(&mutex->lock);
+	
+	if (waiter == NULL) return;
+	
+	if (handoff && direct) {
+		cancel_deadline(waiter);
+		
+		worker_t *worker = current_worker();
+		green_t *suspended = worker->running;
+		worker->requeue = suspended;
+		switch_to(worker, suspended, waiter);
+	} else {
+		wake_waiter(waiter);
+	}
+}
+
+void green_cond_init(green_cond_t *condition) {
+	init_queue(&condition->queue);
+	condition->mutex = NULL;
+	condition->lock = FALSE;
+	condition->posted = 0;
+	condition->pending = 0;
+	condition->post_next = NULL;
+}
+
+/// Move a waiter popped off a condition straight onto the wait queue of the mutex it relocks
+///
+/// Waking it while the mutex is held would only have it block again, so unless forced
+/// it's only moved if the mutex is taken, expects the condition locked
+/// Returns FALSE if the waiter should be woken instead
+static int morph_waiter(green_mutex_t *mutex, green_t *thread, int force) {
+	if (mutex == NULL) return FALSE;
+	
+	spin_lock(&mutex->lock);
+	int morph = force || mutex->taken;
+	if (morph) {
+		cancel_deadline(thread);
+		mutex_wait(mutex, thread, FALSE);
+	}
+	spin_unlock(&mutex->lock);
+	
+	return morph;
+}
+
+int green_cond_wait(green_cond_t *condition, green_mutex_t *mutex) {
+	block_interrupts();
+	spin_lock(&condition->lock);
+	
+	// A posted signal got here before us, it's ours without letting go of the mutex
+	if (condition->pending > 0) {
+		condition->pending--;
+		spin_unlock(&condition->lock);
+		unblock_interrupts();
+		return 0;
+	}
+	
+	push_queue(&condition->queue, current_worker()->running);
+	condition->mutex = mutex;
+	
+	// We are on the queue before the mutex is released, so no signal can be missed
+	if (mutex != NULL) mutex_release(mutex, FALSE);
+	
+	schedule(&condition->lock);
+	
+	// Remember, we got swapped back into focus now
+	if (mutex != NULL) mutex_acquire(mutex);
+	
+	unblock_interrupts();
+	
+	return 0;
+}
+
+int green_cond_timedwait(green_cond_t *condition, green_mutex_t *mutex, const struct timespec *deadline) {
+	block_interrupts();
+	spin_lock(&condition->lock);
+	
+	if (condition->pending > 0) {
+		condition->pending--;
+		spin_unlock(&condition->lock);
+		unblock_interrupts();
+		return 0;
+	}
+	
+	push_queue(&condition->queue, current_worker()->running);
+	condition->mutex = mutex;
+	
+	if (mutex != NULL) mutex_release(mutex, FALSE);
+	
+	int expired = schedule_until(&condition->queue, &condition->lock, timespec_ns(deadline));
+	
+	if (mutex != NULL) mutex_acquire(mutex);
+	
+	unblock_interrupts();
+	
+	return expired ? ETIMEDOUT : 0;
+}
+
+/// green_cond_signal without touching interrupts
+///
+/// A posted signal that finds nobody waiting is kept for the next waiter
+static void cond_signal(green_cond_t *condition, int posted) {
+	green_t *waiter = NULL;
+	
+	spin_lock(&condition->lock);
+	waiter = pop_waiter(&condition->queue);
+	if (waiter == NULL && posted) condition->pending++;
+	if (waiter != NULL && morph_waiter(condition->mutex, waiter, FALSE)) waiter = NULL;
+	spin_unlock(&condition->lock);
+	
+	if (waiter != NULL) wake_waiter(waiter);
+}
+
+void green_cond_signal(green_cond_t *condition) {
+	if (condition->queue.front == NULL) return;
+	
+	// Fairly straight forward
+	block_interrupts();
+	cond_signal(condition, FALSE);
+	unblock_interrupts();
+}
+
+void green_post_signal(green_cond_t *condition) {
+	// Only the first post since the last drain links the condition, the rest just count
+	if (__atomic_fetch_add(&condition->posted, 1, __ATOMIC_ACQ_REL) > 0) return;
+	
+	green_cond_t *head = __atomic_load_n(&posted_signals, __ATOMIC_RELAXED);
+	do {
+		condition->post_next = head;
+	} while (!__atomic_compare_exchange_n(&posted_signals, &head, condition, TRUE, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	
+	wake_any();
+}
+
+/// Carry out the signals posted from other OS threads, the whole batch at once
+///
+/// Expects interrupts blocked and no locks held
+static void drain_signals() {
+	if (__atomic_load_n(&posted_signals, __ATOMIC_RELAXED) == NULL) return;
+	
+	green_cond_t *condition = __atomic_exchange_n(&posted_signals, NULL, __ATOMIC_ACQUIRE);
+	while (condition != NULL) {
+		// A post after the count is taken links the condition again, so next has to be read first
+		green_cond_t *next = condition->post_next;
+		int count = __atomic_exchange_n(&condition->posted, 0, __ATOMIC_ACQ_REL);
+		while (count-- > 0) cond_signal(condition, TRUE);
+		condition = next;
+	}
+}
+
+void green_cond_broadcast(green_cond_t *condition) {
+	if (condition->queue.front == NULL) return;
+	
+	block_interrupts();
+	green_queue_t woken;
+	init_queue(&woken);
+	
+	// Once one waiter is woken to take the mutex, the rest line up behind it on the mutex,
+	// each unlock passes it on to the next one
+	spin_lock(&condition->lock);
+	green_t *waiter;
+	while ((waiter = pop_waiter(&condition->queue)) != NULL) {
+		if (!morph_waiter(condition->mutex, waiter, woken.front != NULL)) push_queue(&woken, waiter);
+	}
+	spin_unlock(&condition->lock);
+	
+	while (woken.front != NULL) wake_waiter(pop_queue(&woken));
+	unblock_interrupts();
+}
+
+#if PREEMPTIVE
+void timer_handler(int sig) {
+	// The queues might be half way through an update, leave the switch to unblock_interrupts()
+	if (interrupts_off) {
+		preempt_pending = TRUE;
+		return;
+	}
+	
+	if (current_worker() == NULL) return;	// not one of our threads
+	
+	int saved_errno = errno;	// polling and waking idle workers make syscalls
+	block_interrupts();
+	tick();
+	unblock_interrupts();
+	errno = saved_errno;
+}
+#endif // PREEMPTIVE
+
+void green_mutex_init(green_mutex_t *mutex) {
+	mutex->taken = FALSE;
+	init_queue(&mutex->queue);
+	mutex->mode = GREEN_MUTEX_BARGING;
+	mutex->handoff = NULL;
+	mutex->starving_since = 0;
+	mutex->lock = FALSE;
+}
+
+void green_mutex_setmode(green_mutex_t *mutex, enum green_mutex_mode mode) {
+	mutex->mode = mode;
+}
+
+int green_mutex_lock(green_mutex_t *mutex) {
+	block_interrupts();
+	mutex_acquire(mutex);
+	unblock_interrupts();
+	
+	return 0;
+}
+
+int green_mutex_timedlock(green_mutex_t *mutex, const struct timespec *deadline) {
+	int expired = FALSE, waited = FALSE;
+	
+	block_interrupts();
+	green_t *running = current_worker()->running;
+	
+	spin_lock(&mutex->lock);
+	while (!mutex_free(mutex, running) && !expired) {
+		mutex_wait(mutex, running, waited);
+		
+		expired = schedule_until(&mutex->queue, &mutex->lock, timespec_ns(deadline));
+		waited = TRUE;
+		spin_lock(&mutex->lock);
+	}
+	
+	// Even past the deadline, a free mutex is ours
+	int result = ETIMEDOUT;
+	if (mutex_free(mutex, running)) {
+		mutex_take(mutex, waited);
+		result = 0;
+	}
+	spin_unlock(&mutex->lock);
+	unblock_interrupts();
+	
+	return result;
+}
+
+int green_mutex_unlock(green_mutex_t *mutex) {
+	block_interrupts();
+	mutex_release(mutex, TRUE);
+	unblock_interrupts();
+	
+	return 0;
+}
+
+void green_rwlock_init(green_rwlock_t *rwlock) {
+	rwlock->readers = 0;
+	rwlock->writer = FALSE;
+	rwlock->prefer_writers = FALSE;
+	init_queue(&rwlock->waiting_readers);
+	init_queue(&rwlock->waiting_writers);
+	rwlock->lock = FALSE;
+}
+
+void green_rwlock_prefer_writers(green_rwlock_t *rwlock, int enable) {
+	rwlock->prefer_writers = enable;
+}
+
+int green_rwlock_rdlock(green_rwlock_t *rwlock) {
+	block_interrupts();
+	spin_lock(&rwlock->lock);
+	
+	int blocked = rwlock->writer || (rwlock->prefer_writers && rwlock->waiting_writers.front != NULL);
+	if (blocked) {
+		// Whoever lets us in counts us as a reader before waking us
+		push_queue(&rwlock->waiting_readers, current_worker()->running);
+		schedule(&rwlock->lock);
+	} else {
+		rwlock->readers++;
+		spin_unlock(&rwlock->lock);
+	}
+	
+	unblock_interrupts();
+	return 0;
+}
+
+int green_rwlock_wrlock(green_rwlock_t *rwlock) {
+	block_interrupts();
+	spin_lock(&rwlock->lock);
+	
+	if (rwlock->writer || rwlock->readers > 0) {
+		// Whoever lets us in marks us as the writer before waking us
+		push_queue(&rwlock->waiting_writers, current_worker()->running);
+		schedule(&rwlock->lock);
+	} else {
+		rwlock->writer = TRUE;
+		spin_unlock(&rwlock->lock);
+	}
+	
+	unblock_interrupts();
+	return 0;
+}
+
+int green_rwlock_unlock(green_rwlock_t *rwlock) {
+	green_t *writer = NULL;
+	green_queue_t readers;
+	init_queue(&readers);
+	int count = 0;
+	
+	block_interrupts();
+	spin_lock(&rwlock->lock);
+	
+	if (rwlock->writer) {
+		rwlock->writer = FALSE;
+	} else {
+		rwlock->readers--;
+	}
+	
+	// Ownership is passed on before waking anyone, so nobody wakes only to block again
+	if (!rwlock->writer && rwlock->readers == 0) {
+		int writer_first = rwlock->waiting_readers.front == NULL || rwlock->prefer_writers;
+		if (writer_first && rwlock->waiting_writers.front != NULL) {
+			writer = pop_queue(&rwlock->waiting_writers);
+			rwlock->writer = TRUE;
+		} else {
+			// Every queued reader gets in at once
+			readers = rwlock->waiting_readers;
+			init_queue(&rwlock->waiting_readers);
+			for (green_t *reader = readers.front; reader != NULL; reader = reader->next) count++;
+			rwlock->readers = count;
+		}
+	}
+	
+	spin_unlock(&rwlock->lock);
+	
+	if (writer != NULL) make_ready(writer);
+	worker_t *worker = current_worker();
+	preempt_for(worker, push_ready_all(worker, &readers));
+	
+	unblock_interrupts();
+	return 0;
+}
+
+void green_sem_init(green_sem_t *semaphore, int value) {
+	semaphore->value = value;
+	init_queue(&semaphore->queue);
+	semaphore->lock = FALSE;
+}
+
+int green_sem_wait(green_sem_t *semaphore) {
+	block_interrupts();
+	spin_lock(&semaphore->lock);
+	
+	if (semaphore->value > 0) {
+		semaphore->value--;
+		spin_unlock(&semaphore->lock);
+	} else {
+		// A post hands its unit straight to us, it never touches the value
+		push_queue(&semaphore->queue, current_worker()->running);
+		schedule(&semaphore->lock);
+	}
+	
+	unblock_interrupts();
+	return 0;
+}
+
+int green_sem_trywait(green_sem_t *semaphore) {
+	int result = -1;
+	
+	block_interrupts();
+	spin_lock(&semaphore->lock);
+	if (semaphore->value > 0) {
+		semaphore->value--;
+		result = 0;
+	}
+	spin_unlock(&semaphore->lock);
+	unblock_interrupts();
+	
+	return result;
+}
+
+int green_sem_post(green_sem_t *semaphore) {
+	green_t *waiter = NULL;
+	
+	block_interrupts();
+	spin_lock(&semaphore->lock);
+	if (semaphore->queue.front != NULL) {
+		waiter = pop_queue(&semaphore->queue);
+	} else {
+		semaphore->value++;
+	}
+	spin_unlock(&semaphore->lock);
+	
+	if (waiter != NULL) make_ready(waiter);
+	unblock_interrupts();
+	
+	return 0;
+}
+
+void green_waitgroup_init(green_waitgroup_t *group) {
+	group->count = 0;
+	init_queue(&group->waiters);
+	group->lock = FALSE;
+}
+
+void green_waitgroup_add(green_waitgroup_t *group, int delta) {
+	// Only reaching zero needs the lock, the rest of the threads finishing never contend on it
+	if (__atomic_add_fetch(&group->count, delta, __ATOMIC_ACQ_REL) != 0) return;
+	
+	block_interrupts();
+	spin_lock(&group->lock);
+	green_queue_t waiters = group->waiters;
+	init_queue(&group->waiters);
+	spin_unlock(&group->lock);
+	
+	worker_t *worker = current_worker();
+	preempt_for(worker, push_ready_all(worker, &waiters));
+	unblock_interrupts();
+}
+
+void green_waitgroup_done(green_waitgroup_t *group) {
+	green_waitgroup_add(group, -1);
+}
+
+void green_waitgroup_wait(green_waitgroup_t *group) {
+	if (__atomic_load_n(&group->count, __ATOMIC_ACQUIRE) == 0) return;
+	
+	block_interrupts();
+	spin_lock(&group->lock);
+	
+	// Checked under the lock, whoever brings it to zero takes the lock after us and sees us queued
+	if (__atomic_load_n(&group->count, __ATOMIC_ACQUIRE) == 0) {
+		spin_unlock(&group->lock);
+	} else {
+		push_queue(&group->waiters, current_worker()->running);
+		schedule(&group->lock);
+	}
+	
+	unblock_interrupts();
+}
+
+int green_chan_init(green_chan_t *chan, size_t elem_size, size_t capacity) {
+	chan->elem_size = elem_size;
+	chan->capacity = capacity;
+	chan->head = chan->count = 0;
+	chan->closed = FALSE;
+	chan->senders.front = chan->senders.back = NULL;
+	chan->receivers.front = chan->receivers.back = NULL;
+	chan->lock = FALSE;
+	
+	chan->buffer = NULL;
+	if (capacity > 0) {
+		chan->buffer = malloc(capacity * elem_size);
+		if (chan->buffer == NULL) return -1;
+	}
+	
+	return 0;
+}
+
+void green_chan_destroy(green_chan_t *chan) {
+	free(chan->buffer);
+	chan->buffer = NULL;
+}
+
+static inline void *chan_slot(green_chan_t *chan, size_t index) {
+	return chan->buffer + (index % chan->capacity) * chan->elem_size;
+}
+
+static void chan_enqueue(green_chan_queue_t *queue, chan_waiter_t *waiter) {
+	waiter->next = NULL;
+	waiter->prev = queue->back;
+	queue->back = (queue->back) ? (queue->back->next = waiter) : (queue->front = waiter);
+	waiter->queued = TRUE;
+}
+
+static void chan_unlink(green_chan_queue_t *queue, chan_waiter_t *waiter) {
+	if (waiter->prev != NULL) {
+		waiter->prev->next = waiter->next;
+	} else {
+		queue->front = waiter->next;
+	}
+	
+	if (waiter->next != NULL) {
+		waiter->next->prev = waiter->prev;
+	} else {
+		queue->back = waiter->prev;
+	}
+	
+	waiter->queued = FALSE;
+}
+
+/// Claim the longest waiting operation that can still complete, NULL if there is none
+///
+/// Cases of selects that already completed elsewhere are dropped on the way, expects the channel locked
+static chan_waiter_t *chan_claim(green_chan_queue_t *queue, chan_select_t **woken) {
+	while (queue->front != NULL) {
+		chan_waiter_t *waiter = queue->front;
+		chan_unlink(queue, waiter);
+		
+		chan_select_t *select = waiter->select;
+		if (__atomic_compare_exchange_n(&select->claimed, &(int){FALSE}, TRUE, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			select->fired = waiter->index;
+			select->ok = TRUE;
+			select->wake_next = *woken;
+			*woken = select;
+			return waiter;
+		}
+	}
+	
+	return NULL;
+}
+
+/// Wake the threads chan_claim() took, with their channels unlocked
+///
+/// They run next, so a blocked receiver gets to its value before the sender goes on
+static void chan_wake(chan_select_t *woken) {
+	while (woken != NULL) {
+		chan_select_t *select = woken;
+		woken = select->wake_next;
+		
+		// A select might still be queueing its cases, it can't be woken before it's parked
+		if (select->multi) {
+			spin_lock(&select->lock);
+			spin_unlock(&select->lock);
+		}
+		
+		push_ready_next(current_worker(), select->thread);
+	}
+}
+
+/// Send without blocking, expects the channel locked
+static int chan_try_send(green_chan_t *chan, const void *value, chan_select_t **woken) {
+	if (chan->closed) return CHAN_CLOSED;
+	
+	// Receivers only wait on an empty buffer, so the value can skip it
+	chan_waiter_t *receiver = chan_claim(&chan->receivers, woken);
+	if (receiver != NULL) {
+		memcpy(receiver->data, value, chan->elem_size);
+		return CHAN_DONE;
+	}
+	
+	if (chan->count < chan->capacity) {
+		memcpy(chan_slot(chan, chan->head + chan->count), value, chan->elem_size);
+		chan->count++;
+		return CHAN_DONE;
+	}
+	
+	return CHAN_BLOCK;
+}
+
+/// Receive without blocking, expects the channel locked
+static int chan_try_recv(green_chan_t *chan, void *value, chan_select_t **woken) {
+	if (chan->count > 0) {
+		memcpy(value, chan_slot(chan, chan->head), chan->elem_size);
+		chan->head = (chan->head + 1) % chan->capacity;
+		chan->count--;
+		
+		// The freed slot goes to the longest blocked sender
+		chan_waiter_t *sender = chan_claim(&chan->senders, woken);
+		if (sender != NULL) {
+			memcpy(chan_slot(chan, chan->head + chan->count), sender->data, chan->elem_size);
+			chan->count++;
+		}
+		
+		return CHAN_DONE;
+	}
+	
+	chan_waiter_t *sender = chan_claim(&chan->senders, woken);
+	if (sender != NULL) {
+		memcpy(value, sender->data, chan->elem_size);
+		return CHAN_DONE;
+	}
+	
+	return chan->closed ? CHAN_CLOSED : CHAN_BLOCK;
+}
+
+/// Park the running thread on a single channel operation, TRUE if it completed, FALSE if the channel closed
+///
+/// Expects interrupts blocked and the channel locked, unlocks it
+static int chan_park(green_chan_t *chan, green_chan_queue_t *queue, void *data) {
+	chan_select_t select;
+	select.thread = current_worker()->running;
+	select.claimed = FALSE;
+	select.multi = FALSE;
+	
+	chan_waiter_t waiter;
+	waiter.select = &select;
+	waiter.data = data;
+	waiter.index = 0;
+	chan_enqueue(queue, &waiter);
+	
+	// Whoever claims us copies the value and unlinks us before waking us
+	schedule(&chan->lock);
+	
+	return select.ok;
+}
+
+size_t green_chan_send_batch(green_chan_t *chan, const void *values, size_t count) {
+	const char *next = values;
+	size_t sent = 0;
+	
+	block_interrupts();
+	while (sent < count) {
+		chan_select_t *woken = NULL;
+		int result = CHAN_DONE;
+		
+		spin_lock(&chan->lock);
+		while (sent < count && (result = chan_try_send(chan, next, &woken)) == CHAN_DONE) {
+			next += chan->elem_size;
+			sent++;
+		}
+		
+		if (result == CHAN_BLOCK && woken == NULL) {
+			// Nobody to hand values to, wait for a receiver to take this one
+			if (!chan_park(chan, &chan->senders, (void *)next)) break;
+			next += chan->elem_size;
+			sent++;
+			continue;
+		}
+		spin_unlock(&chan->lock);
+		
+		// Wake the receivers before blocking, the channel may well have room by then
+		chan_wake(woken);
+		if (result == CHAN_CLOSED) break;
+	}
+	unblock_interrupts();
+	
+	return sent;
+}
+
+size_t green_chan_recv_batch(green_chan_t *chan, void *values, size_t count) {
+	char *next = values;
+	size_t received = 0;
+	
+	block_interrupts();
+	while (received < count) {
+		chan_select_t *woken = NULL;
+		int result = CHAN_DONE;
+		
+		spin_lock(&chan->lock);
+		while (received < count && (result = chan_try_recv(chan, next, &woken)) == CHAN_DONE) {
+			next += chan->elem_size;
+			received++;
+		}
+		
+		// Only block for the first value, after that take what's there
+		if (result == CHAN_BLOCK && received == 0 && woken == NULL) {
+			if (!chan_park(chan, &chan->receivers, next)) break;
+			next += chan->elem_size;
+			received++;
+			continue;
+		}
+		spin_unlock(&chan->lock);
+		
+		chan_wake(woken);
+		if (result != CHAN_DONE) break;
+	}
+	unblock_interrupts();
+	
+	return received;
+}
+
+int green_chan_send(green_chan_t *chan, const void *value) {
+	return (green_chan_send_batch(chan, value, 1) == 1) ? 0 : -1;
+}
+
+int green_chan_recv(green_chan_t *chan, void *value) {
+	return (green_chan_recv_batch(chan, value, 1) == 1) ? 0 : -1;
+}
+
+void green_chan_close(green_chan_t *chan) {
+	chan_select_t *woken = NULL;
+	
+	block_interrupts();
+	spin_lock(&chan->lock);
+	chan->closed = TRUE;
+	
+	// Everyone blocked fails, buffered values can still be received
+	chan_waiter_t *waiter;
+	while ((waiter = chan_claim(&chan->receivers, &woken)) != NULL) waiter->select->ok = FALSE;
+	while ((waiter = chan_claim(&chan->senders, &woken)) != NULL) waiter->select->ok = FALSE;
+	spin_unlock(&chan->lock);
+	
+	chan_wake(woken);
+	unblock_interrupts();
+}
+
+int green_select(green_select_case_t *cases, int count, int block) {
+	if (count < 1) return -1;	// nothing could ever complete
+	
+	// Thread stacks are small, a large select would run off the guard page
+	green_chan_t *inline_channels[SELECT_INLINE];
+	chan_waiter_t inline_waiters[SELECT_INLINE];
+	green_chan_t **channels = inline_channels;
+	chan_waiter_t *waiters = inline_waiters;
+	void *more = NULL;
+	
+	block_interrupts();
+	if (count > SELECT_INLINE) {
+		// One block for both, the waiters first keep the pointers after them aligned
+		more = malloc(count * (sizeof(chan_waiter_t) + sizeof(green_chan_t *)));
+		if (more == NULL) {
+			unblock_interrupts();
+			errno = ENOMEM;
+			return -1;
+		}
+		waiters = more;
+		channels = (green_chan_t **)(waiters + count);
+	}
+	
+	// Every channel is locked for the whole check, in address order so selects can't deadlock each other
+	int locked = 0;
+	for (int i = 0; i < count; ++i) {
+		int at = locked;
+		while (at > 0 && channels[at - 1] > cases[i].chan) at--;
+		if (at > 0 && channels[at - 1] == cases[i].chan) continue;
+		
+		for (int j = locked; j > at; --j) channels[j] = channels[j - 1];
+		channels[at] = cases[i].chan;
+		locked++;
+	}
+	
+	worker_t *worker = current_worker();
+	chan_select_t *woken = NULL;
+	
+	for (int i = 0; i < locked; ++i) spin_lock(&channels[i]->lock);
+	
+	// Start at a random case, so none of them gets starved
+	int start = rand_r(&worker->seed) % count;
+	for (int i = 0; i < count; ++i) {
+		green_select_case_t *option = &cases[(start + i) % count];
+		int result = option->send ? chan_try_send(option->chan, option->value, &woken) :
+			chan_try_recv(option->chan, option->value, &woken);
+		if (result == CHAN_BLOCK) continue;
+		
+		for (int j = 0; j < locked; ++j) spin_unlock(&channels[j]->lock);
+		chan_wake(woken);
+		free(more);
+		unblock_interrupts();
+		
+		option->ok = (result == CHAN_DONE);
+		return (start + i) % count;
+	}
+	
+	if (!block) {
+		for (int i = 0; i < locked; ++i) spin_unlock(&channels[i]->lock);
+		free(more);
+		unblock_interrupts();
+		return -1;
+	}
+	
+	// Queue on every channel, nobody can claim us before they're unlocked,
+	// and we hold our own lock until we're parked
+	chan_select_t select;
+	select.thread = worker->running;
+	select.claimed = FALSE;
+	select.multi = TRUE;
+	select.lock = FALSE;
+	spin_lock(&select.lock);
+	
+	for (int i = 0; i < count; ++i) {
+		waiters[i].select = &select;
+		waiters[i].data = cases[i].value;
+		waiters[i].index = i;
+		chan_enqueue(cases[i].send ? &cases[i].chan->senders : &cases[i].chan->receivers, &waiters[i]);
+	}
+	
+	for (int i = 0; i < locked; ++i) spin_unlock(&channels[i]->lock);
+	schedule(&select.lock);
+	
+	// Take the cases that didn't fire back off their channels
+	for (int i = 0; i < count; ++i) {
+		green_chan_t *chan = cases[i].chan;
+		spin_lock(&chan->lock);
+		if (waiters[i].queued) chan_unlink(cases[i].send ? &chan->senders : &chan->receivers, &waiters[i]);
+		spin_unlock(&chan->lock);
+	}
+	free(more);
+	unblock_interrupts();
+	
+	cases[select.fired].ok = select.ok;
+	return select.fired;
+}
+
+int green_wait_fd(int fd, int events) {
+	block_interrupts();
+	fd_state_t *state = get_fd_state(fd);
+	if (state == NULL) {
+		unblock_interrupts();
+		errno = (fd < 0) ? EBADF : ENOMEM;
+		return -1;
+	}
+	
+	// Registering again is cheaper than finding out whether the fd was closed and reused since
+	struct epoll_event event = {0};
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.ptr = state;
+	if (epoll_ctl(poll_fd, EPOLL_CTL_ADD, fd, &event) != 0 && errno != EEXIST) {
+		int error = errno;
+		unblock_interrupts();
+		
+		// Regular files can't be polled, they are always ready
+		if (error == EPERM) return events;
+		
+		errno = error;
+		return -1;
+	}
+	
+	spin_lock(&state->lock);
+	if (state->ready & events) {
+		int revents = state->ready & events;
+		state->ready &= ~revents;
+		spin_unlock(&state->lock);
+		unblock_interrupts();
+		return revents;
+	}
+	
+	fd_waiter_t waiter = {current_worker()->running, events, 0, {NULL, NULL}};
+	if (events & EPOLLIN) {
+		waiter.next[FD_IN] = state->waiters[FD_IN];
+		state->waiters[FD_IN] = &waiter;
+	}
+	if (events & EPOLLOUT) {
+		waiter.next[FD_OUT] = state->waiters[FD_OUT];
+		state->waiters[FD_OUT] = &waiter;
+	}
+	
+	__atomic_add_fetch(&io_waiters, 1, __ATOMIC_SEQ_CST);
+	schedule(&state->lock);
+	__atomic_sub_fetch(&io_waiters, 1, __ATOMIC_SEQ_CST);
+	unblock_interrupts();
+	
+	return waiter.revents;
+}
+
+/// Make sure an fd won't block the worker
+static int set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0) return -1;
+	if (flags & O_NONBLOCK) return 0;
+	
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+ssize_t green_read(int fd, void *buffer, size_t count) {
+	if (set_nonblocking(fd) != 0) return -1;
+	
+	while (1) {
+		ssize_t result = read(fd, buffer, count);
+		if (result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return result;
+		
+		if (green_wait_fd(fd, EPOLLIN) < 0) return -1;
+	}
+}
+
+ssize_t green_write(int fd, const void *buffer, size_t count) {
+	if (set_nonblocking(fd) != 0) return -1;
+	
+	while (1) {
+		ssize_t result = write(fd, buffer, count);
+		if (result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return result;
+		
+		if (green_wait_fd(fd, EPOLLOUT) < 0) return -1;
+	}
+}
+
+int green_accept(int fd, struct sockaddr *address, socklen_t *length) {
+	if (set_nonblocking(fd) != 0) return -1;
+	
+	while (1) {
+		int result = accept(fd, address, length);
+		if (result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return result;
+		
+		if (green_wait_fd(fd, EPOLLIN) < 0) return -1;
+	}
+}
+
+int green_connect(int fd, const struct sockaddr *address, socklen_t length) {
+	if (set_nonblocking(fd) != 0) return -1;
+	
+	if (connect(fd, address, length) == 0) return 0;
+	if (errno != EINPROGRESS) return -1;
+	
+	// Writable means the connection attempt is over, SO_ERROR tells how it went
+	if (green_wait_fd(fd, EPOLLOUT) < 0) return -1;
+	
+	int error = 0;
+	socklen_t size = sizeof(error);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) != 0) return -1;
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	
+	return 0;
+}
+
+/// Park the running thread until the request has completed
+///
+/// Expects interrupts blocked
+static void park_request(io_request_t *request) {
+	if (io_backend == IO_UNKNOWN) setup_io();
+	
+	worker_t *worker = current_worker();
+	request->thread = worker->running;
+	worker->submit = request;
+	
+	// Counts as waiting on I/O, so an idle worker polls for the completion
+	__atomic_add_fetch(&io_waiters, 1, __ATOMIC_SEQ_CST);
+	schedule(NULL);
+	__atomic_sub_fetch(&io_waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/// Park the running thread on a file operation
+static ssize_t file_io(int opcode, int fd, void *buffer, size_t count, off_t offset) {
+	io_request_t request = {0};
+	request.opcode = opcode;
+	request.fd = fd;
+	request.iov.iov_base = buffer;
+	request.iov.iov_len = count;
+	request.offset = offset;
+	
+	block_interrupts();
+	park_request(&request);
+	unblock_interrupts();
+	
+	if (request.result < 0) {
+		errno = -request.result;
+		return -1;
+	}
+	
+	return request.result;
+}
+
+ssize_t green_pread(int fd, void *buffer, size_t count, off_t offset) {
+	return file_io(IORING_OP_READV, fd, buffer, count, offset);
+}
+
+ssize_t green_pwrite(int fd, const void *buffer, size_t count, off_t offset) {
+	return file_io(IORING_OP_WRITEV, fd, (void *)buffer, count, offset);
+}
+
+int green_fsync(int fd) {
+	return file_io(IORING_OP_FSYNC, fd, NULL, 0, 0);
+}
+
+void *green_offload(void *(*func)(void *), void *arg) {
+	io_request_t request = {0};
+	request.func = func;
+	request.arg = arg;
+	
+	block_interrupts();
+	park_request(&request);
+	unblock_interrupts();
+	
+	return request.value;
+}
+
+void green_offload_stats(green_offload_stats_t *stats) {
+	pthread_mutex_lock(&helpers_lock);
+	*stats = helper_stats;
+	pthread_mutex_unlock(&helpers_lock);
+}
+
+static void sleep_until(unsigned long deadline) {
+	sleeper_t sleeper;
+	sleeper.deadline = deadline;
+	sleeper.queue = NULL;
+	sleeper.lock = NULL;
+	
+	block_interrupts();
+	sleeper.thread = current_worker()->running;
+	
+	// Locked until we're off the stack, the expiry can't resume us before that
+	spin_lock(&timers_lock);
+	add_timer(&sleeper);
+	schedule(&timers_lock);
+	unblock_interrupts();
+}
+
+void green_sleep_ns(long long ns) {
+	sleep_until(monotonic_ns() + ((ns > 0) ? ns : 0));
+}
+
+void green_sleep_until(const struct timespec *deadline) {
+	sleep_until(timespec_ns(deadline));
+}
+
+unsigned long green_switch_count() {
+	unsigned long switches = 0;
+	int count = __atomic_load_n(&worker_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < count; ++i) {
+		switches += __atomic_load_n(&workers[i].switches, __ATOMIC_RELAXED);
+	}
+	
+	return switches;
 }
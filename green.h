@@ -1,26 +1,101 @@
+#include <stddef.h>
+#include <time.h>
 #include <ucontext.h>
 
+#include <sys/socket.h>
+#include <sys/types.h>
+
+// Targets with a hand-written context switch, the rest fall back to ucontext
+// Define GREEN_UCONTEXT to 1 to force the fallback
+#ifndef GREEN_UCONTEXT
+#if defined(__x86_64__) || defined(__aarch64__)
+#define GREEN_UCONTEXT 0
+#else
+#define GREEN_UCONTEXT 1
+#endif
+#endif // GREEN_UCONTEXT
+
+/// Thread-specific data slots kept inside green_t, later keys get an array allocated on first use
+#ifndef GREEN_KEYS_INLINE
+#define GREEN_KEYS_INLINE 4
+#endif // GREEN_KEYS_INLINE
+
+/// Saved execution state of a suspended thread
+///
+/// The hand-written switch pushes callee-saved registers onto the thread's own stack,
+/// so all it has to remember is the stack pointer
+#if GREEN_UCONTEXT
+typedef ucontext_t green_context_t;
+#else
+typedef struct green_context_t {
+	void *sp;
+} green_context_t;
+#endif // GREEN_UCONTEXT
+
+/// Basic queue header for this library
+///
+/// Threads link both ways, so a waiter that gives up can leave from anywhere in the queue
+typedef struct green_queue_t {
+	struct green_t *front, *back;
+} green_queue_t;
+
+/// Scheduling class of a thread, a runnable thread of a higher class always goes first
+///
+/// Lower classes still get a turn every so often, so they can't starve
+enum green_priority {
+	GREEN_PRIORITY_INTERACTIVE,	// latency sensitive, preempts the lower classes as soon as it wakes
+	GREEN_PRIORITY_NORMAL,		// the default
+	GREEN_PRIORITY_BATCH,		// background work, runs when nothing else wants to
+};
+
 /// Thread information structure
 ///
 /// Contains all necessary info for a given thread
 /// Avoid modifying it outside of the library
 /// Use green_create() function to initialize
 typedef struct green_t {
-	ucontext_t *context;
+	green_context_t context;
+	void *stack;	// lowest usable address, a guard page sits right below it
+	size_t stack_size;
+	size_t stack_peak;	// deepest stack use in bytes, set on exit if the stack was profiled
+	int stack_profiled;
 	
 	void *(*func)(void *);
 	void *arg;
+	void *result;	// what func returned, once the thread is a zombie
 	
 	struct green_t *next;
-	struct green_t *join;
+	struct green_t *prev;
+	int ready_on;	// worker whose run queue holds the thread, -1 if it isn't runnable
+	enum green_priority priority;
+	green_queue_t join;
+	void *timeout;	// deadline of the timed wait in progress, NULL otherwise
+	void *watchers;	// green_join_any() and green_join_all() callers waiting on this thread
+	int park_state;	// green_park() and green_wake() handshake, may be set from any OS thread
+	
+	void *specific[GREEN_KEYS_INLINE];	// values of the first keys
+	void **specific_more;	// values of the rest, NULL until one is set
+	
+	volatile int zombie;
+	int detached;	// nobody joins it
+	int pooled;	// the library owns the structure and takes it back on exit
 	
-	int zombie;
+	int lock;	// spinlock guarding join, zombie and detached between worker threads
 } green_t;
 
-/// Basic queue header for this library
-typedef struct green_queue_t {
-	struct green_t *front, *back;
-} green_queue_t;
+/// Thread-specific data key, attempts to mirror pthread_key_t
+typedef unsigned int green_key_t;
+
+/// Stack size that lets the library pick a size class from the entry function's profile
+#define GREEN_STACK_AUTO	0
+
+/// Thread attributes
+///
+/// Attempts to mirror pthread_attr_t, initialize with green_attr_init()
+typedef struct green_attr_t {
+	size_t stack_size;
+	enum green_priority priority;
+} green_attr_t;
 
 /// Conditional variable structure
 ///
@@ -29,6 +104,11 @@ typedef struct green_queue_t {
 /// Use provided functions to work with the variable
 typedef struct green_cond_t {
 	struct green_queue_t queue;
+	struct green_mutex_t *mutex;	// the waiters relock it, so signals can move them straight onto it
+	int lock;	// spinlock guarding the queue between worker threads
+	int posted;	// green_post_signal() calls the scheduler hasn't carried out yet
+	int pending;	// posted signals that found nobody waiting, each lets one later wait return at once
+	struct green_cond_t *post_next;	// next condition with posted signals
 } green_cond_t;
 
 /// Mutex structure
@@ -38,18 +118,266 @@ typedef struct green_cond_t {
 typedef struct green_mutex_t {
 	volatile int			taken;
 	struct green_queue_t	queue;
+	int						mode;
+	struct green_t			*handoff;	// waiter the mutex was handed to, it's taken on its behalf
+	unsigned long			starving_since;	// adaptive mode, since when waiters went without the mutex
+	int						lock;	// spinlock guarding the above between worker threads
 } green_mutex_t;
 
+/// How an unlock passes the mutex on when threads are waiting
+enum green_mutex_mode {
+	GREEN_MUTEX_BARGING,	// the oldest waiter is woken to retry, any thread can take the mutex first (the default)
+	GREEN_MUTEX_HANDOFF,	// the oldest waiter owns the mutex right away and runs in place of the unlocker
+	GREEN_MUTEX_ADAPTIVE,	// barging, but handing off once waiters have gone without the mutex for a millisecond
+};
+
+/// Clock the preemption quantum runs on
+enum green_clock {
+	GREEN_CLOCK_CPU,		// process CPU time through ITIMER_VIRTUAL, it stands still while threads wait in syscalls (the default)
+	GREEN_CLOCK_MONOTONIC,	// wall time through a timer per worker, like any signal it interrupts blocking syscalls
+};
+
+/// Where a woken thread is put on the run queue
+///
+/// Threads that yield or get preempted always go to the back, the policy only orders wakeups
+enum green_sched_policy {
+	GREEN_SCHED_FIFO,	// behind everything already runnable (the default)
+	GREEN_SCHED_LIFO,	// in front, so it runs next while its data is still in cache, every few wakeups go to the back to bound unfairness
+	GREEN_SCHED_RANDOM,	// in front or at the back by a coin flip
+};
+
+/// Reader-writer lock structure
+///
+/// Any number of readers or a single writer hold it at a time
+/// Avoid modifying it outside of the library
+/// Use provided functions to work with the lock
+typedef struct green_rwlock_t {
+	volatile int			readers;	// holding it shared
+	volatile int			writer;		// holding it exclusively
+	int						prefer_writers;
+	struct green_queue_t	waiting_readers;
+	struct green_queue_t	waiting_writers;
+	int						lock;	// spinlock guarding the above between worker threads
+} green_rwlock_t;
+
+/// Counting semaphore structure
+///
+/// Avoid modifying it outside of the library
+/// Use provided functions to work with the semaphore
+typedef struct green_sem_t {
+	int						value;
+	struct green_queue_t	queue;
+	int						lock;	// spinlock guarding the above between worker threads
+} green_sem_t;
+
+/// Wait group structure, waits for a count of outstanding tasks to drop to zero
+///
+/// Avoid modifying it outside of the library
+/// Use provided functions to work with the group
+typedef struct green_waitgroup_t {
+	int						count;
+	struct green_queue_t	waiters;
+	int						lock;	// spinlock guarding the waiters between worker threads
+} green_waitgroup_t;
+
+/// Queue of channel operations, internal to the library
+typedef struct green_chan_queue_t {
+	struct green_chan_waiter_t *front, *back;
+} green_chan_queue_t;
+
+/// Channel structure, passes fixed size values between threads in order
+///
+/// Avoid modifying it outside of the library
+/// Use provided functions to work with the channel
+typedef struct green_chan_t {
+	size_t				elem_size;
+	size_t				capacity;	// values the buffer holds, 0 is unbuffered
+	char				*buffer;
+	size_t				head, count;
+	int					closed;
+	green_chan_queue_t	senders;	// blocked because the buffer is full
+	green_chan_queue_t	receivers;	// blocked because the buffer is empty
+	int					lock;	// spinlock guarding the above between worker threads
+} green_chan_t;
+
+/// One operation green_select() picks from
+typedef struct green_select_case_t {
+	green_chan_t	*chan;
+	int				send;	// send the value if set, receive into it otherwise
+	void			*value;
+	int				ok;		// set if the case fired, 0 if that was because the channel is closed
+} green_select_case_t;
+
 /// Create and start execution of a new thread
 ///
 /// Attempts to mirror pthread_create() functionality
 int green_create(green_t *thread, void *(*func)(void *), void *agc);
 
+/// Create and start execution of a new thread with given attributes
+///
+/// A NULL attr is the same as green_create()
+/// Returns -1 if the stack can't be mapped
+int green_create_attr(green_t *thread, const green_attr_t *attr, void *(*func)(void *), void *arg);
+
+/// Initialize thread attributes to the defaults
+void green_attr_init(green_attr_t *);
+
+/// Set the stack size threads created with the attributes get
+///
+/// The size is rounded up to a pooled size class, the largest ones are only reserved,
+/// physical memory backs the pages a thread actually touches
+/// GREEN_STACK_AUTO picks the smallest class that fits the deepest use profiled for the entry function
+/// plus some headroom, or the default size if it hasn't been profiled yet
+int green_attr_setstacksize(green_attr_t *, size_t);
+
+/// Set the scheduling class threads created with the attributes get, see green_priority
+///
+/// Returns -1 if the class is unknown
+int green_attr_setpriority(green_attr_t *, enum green_priority);
+
+/// Turn stack profiling on or off
+///
+/// New threads get their stack filled with a pattern, on exit the untouched part is measured,
+/// the result lands in green_t.stack_peak and the profile of the thread's entry function
+/// The filling touches every page, so don't leave it on for threads with huge stacks
+void green_stack_profile(int enable);
+
+/// Deepest stack use profiled for threads starting at the given function, 0 if there is none
+size_t green_stack_peak(void *(*func)(void *));
+
+/// Set the number of worker OS threads green threads are scheduled onto
+///
+/// Attempts to mirror pthread_setconcurrency() functionality
+/// The calling thread is always the first worker, so 1 (the default) is the classic single-core mode
+/// Extra workers keep their own run queues and steal from each other when idle
+/// The count can only grow, returns -1 if it is out of range
+int green_set_concurrency(int count);
+
+/// Set how long a thread runs before it is preempted, and on which clock, see green_clock
+///
+/// A quantum of 0 turns preemption off, threads then only switch when they block or yield
+/// It is also the slice green_maybe_yield() measures, the only use it has in a cooperative build
+/// Returns -1 if the clock is unknown or a worker's timer can't be created
+int green_set_quantum(unsigned long ns, enum green_clock);
+
+/// Turn tickless mode on or off
+///
+/// The timer is then only armed while a worker has threads waiting behind the running one,
+/// or a sleeper or fd waiter a tick might have to wake, so idle and single thread processes take no signals
+void green_set_tickless(int enable);
+
+/// Set how woken threads are ordered on the run queues, see green_sched_policy
+///
+/// Takes effect for the following wakeups, returns -1 if the policy is unknown
+int green_set_policy(enum green_sched_policy);
+
+/// Change the scheduling class of the calling thread, see green_priority
+///
+/// Returns -1 if the class is unknown
+int green_set_priority(enum green_priority);
+
 /// Yield current execution and let a different thread execute
+///
+/// Only threads of the same or a higher class get to run, unless a lower class is due its turn
 int green_yield();
 
+/// Yield only if the current thread has used up its quantum or a higher class thread is waiting
+///
+/// Costs a cycle counter read otherwise, so long loops can call it often
+/// The preemption points of a library built with PREEMPTIVE=0, which has no timer or signals
+void green_maybe_yield();
+
+/// Yield to a given runnable thread, it runs next in place of the current one
+///
+/// The current thread goes to the back of the run queue like with green_yield()
+/// If the thread isn't runnable this is a plain green_yield() and returns -1
+int green_yield_to(green_t *);
+
+/// Create a new detached thread on a green_t the library owns
+///
+/// The structure comes from a free list and goes back to it when the thread exits,
+/// so short-lived threads can be spawned without allocating, attr may be NULL
+/// Returns -1 if no stack or structure can be allocated
+int green_create_detached(const green_attr_t *, void *(*func)(void *), void *arg);
+
+/// Mark a thread as one nobody will join
+///
+/// Attempts to mirror pthread_detach(), the green_t still has to outlive the thread
+/// Joining it afterwards fails with EINVAL
+/// Returns -1 if the thread was already detached
+int green_detach(green_t *);
+
+/// The thread calling this, main and detached threads included
+///
+/// Mostly for handing to green_wake() before parking, a detached thread's structure
+/// is only good until it exits
+green_t *green_self();
+
+/// Suspend the current thread until green_wake() is called on it
+///
+/// A wake that came first is remembered and makes the next park return right away,
+/// several of them count as one, so callers should recheck whatever they wait for
+void green_park();
+
+/// Wake a thread suspended in green_park(), or have its next park return right away
+///
+/// Safe to call from any OS thread, not only workers, it takes no locks and never blocks
+void green_wake(green_t *);
+
 /// Wait for a given thread to finish execution
-int green_join(green_t *);
+///
+/// Attempts to mirror pthread_join(), result gets what the thread returned unless it's NULL
+/// Returns EINVAL if the thread is detached
+int green_join(green_t *, void **result);
+
+/// Wait for the first of count threads to finish execution
+///
+/// Returns its index, result gets what it returned unless it's NULL
+/// The caller is woken once, by that thread's exit, threads already finished are picked right away
+/// Returns -1 with errno set to EINVAL if count is below 1 or a thread is detached,
+/// or to ENOMEM if the wait can't be set up
+int green_join_any(green_t **threads, int count, void **result);
+
+/// Wait for all of count threads to finish execution
+///
+/// results gets what each of them returned unless it's NULL
+/// The caller is woken once, by the last exit
+/// Returns -1 with errno set to EINVAL if a thread is detached, or to ENOMEM if the wait can't be set up
+int green_join_all(green_t **threads, int count, void **results);
+
+/// Create a key for thread-specific data, every thread starts with a NULL value for it
+///
+/// Attempts to mirror pthread_key_create(), keys can't be deleted though
+/// When a thread exits the destructor, if any, is called with each non-NULL value it left
+/// Returns -1 once all keys are taken
+int green_key_create(green_key_t *, void (*destructor)(void *));
+
+/// Value the calling thread set for the key, NULL if it never did
+void *green_getspecific(green_key_t);
+
+/// Set the calling thread's value for the key
+///
+/// Returns -1 if the key was never created or its storage can't be allocated
+int green_setspecific(green_key_t, const void *value);
+
+/// Number of context switches done so far, across all workers
+unsigned long green_switch_count();
+
+/// Suspend the current thread for at least ns nanoseconds
+///
+/// Attempts to mirror nanosleep(), other threads keep running meanwhile
+void green_sleep_ns(long long ns);
+
+/// Suspend the current thread until a CLOCK_MONOTONIC deadline
+///
+/// Attempts to mirror clock_nanosleep() with TIMER_ABSTIME
+void green_sleep_until(const struct timespec *deadline);
+
+/// Wait for a given thread to finish execution, or for a CLOCK_MONOTONIC deadline to pass
+///
+/// Attempts to mirror pthread_timedjoin_np(), returns ETIMEDOUT if the deadline passed first
+/// or EINVAL if the thread is detached
+int green_join_timeout(green_t *, void **result, const struct timespec *deadline);
 
 /// Initialize a conditional variable
 void green_cond_init(green_cond_t *);
@@ -60,18 +388,212 @@ void green_cond_init(green_cond_t *);
 /// This is necessary to avoid missing a cond_signal
 int green_cond_wait(green_cond_t *condition, green_mutex_t *mutex);
 
+/// Suspend the current thread on the condition until signaled or a CLOCK_MONOTONIC deadline passes
+///
+/// Attempts to mirror pthread_cond_timedwait(), returns ETIMEDOUT if the deadline passed first
+/// The mutex is held again on return either way
+int green_cond_timedwait(green_cond_t *condition, green_mutex_t *mutex, const struct timespec *deadline);
+
 /// Signal a thread on condition
 ///
 /// Similar to pthread_cond_signal has no effect if no thread is currently waiting on condition
 void green_cond_signal(green_cond_t *);
 
+/// Signal every thread on condition
+///
+/// Attempts to mirror pthread_cond_broadcast()
+/// Waiters are queued on the mutex they waited with instead of all waking to fight over it,
+/// so like with pthreads all concurrent waiters should use the same mutex
+void green_cond_broadcast(green_cond_t *);
+
+/// Signal a thread on condition from any OS thread, not only workers
+///
+/// The signal is queued without taking locks, and a worker carries it out
+/// like green_cond_signal() the next time it switches threads or goes idle
+/// The poster can't hold the mutex, so a signal that finds nobody waiting isn't dropped,
+/// it makes the next wait on the condition return right away instead
+/// A sleeping worker is woken for it through an eventfd
+void green_post_signal(green_cond_t *);
+
 /// Initialize provided mutex
 void green_mutex_init(green_mutex_t *);
 
+/// Pick how the mutex is passed on, see green_mutex_mode
+///
+/// Barging keeps a running thread going, but a woken waiter may find the mutex taken again,
+/// handing off never wastes a wakeup, but every contended unlock costs a switch
+/// Only change it while nobody holds or waits on the mutex
+void green_mutex_setmode(green_mutex_t *, enum green_mutex_mode);
+
 /// Aquire a lock for given mutex mutex
 ///
 /// Trying to lock a locked mutex will suspend thread until it is unlocked
 int green_mutex_lock(green_mutex_t *);
 
+/// Aquire a lock for given mutex, giving up once a CLOCK_MONOTONIC deadline passes
+///
+/// Attempts to mirror pthread_mutex_timedlock(), returns ETIMEDOUT if the deadline passed first
+int green_mutex_timedlock(green_mutex_t *, const struct timespec *deadline);
+
 /// Release the lock for a given mutex
 int green_mutex_unlock(green_mutex_t *);
+
+/// Initialize provided reader-writer lock
+///
+/// Readers are preferred by default, one gets in whenever no writer holds the lock
+void green_rwlock_init(green_rwlock_t *);
+
+/// Turn writer preference on or off
+///
+/// With it on, readers queue up behind any waiting writer so a steady stream of readers can't starve writers,
+/// and a writer releasing the lock passes it to the next writer before the readers
+void green_rwlock_prefer_writers(green_rwlock_t *, int enable);
+
+/// Acquire the lock shared
+///
+/// Attempts to mirror pthread_rwlock_rdlock()
+int green_rwlock_rdlock(green_rwlock_t *);
+
+/// Acquire the lock exclusively
+///
+/// Attempts to mirror pthread_rwlock_wrlock()
+int green_rwlock_wrlock(green_rwlock_t *);
+
+/// Release the lock, whichever way it's held
+///
+/// Attempts to mirror pthread_rwlock_unlock()
+/// The lock is handed straight to the next waiting writer or to every waiting reader at once
+int green_rwlock_unlock(green_rwlock_t *);
+
+/// Initialize provided semaphore with a number of units
+void green_sem_init(green_sem_t *, int value);
+
+/// Take a unit, suspending the thread until one is posted if there are none
+///
+/// Attempts to mirror sem_wait(), units are passed to waiters in the order they came
+int green_sem_wait(green_sem_t *);
+
+/// Take a unit if there is one, returns -1 otherwise
+///
+/// Attempts to mirror sem_trywait()
+int green_sem_trywait(green_sem_t *);
+
+/// Give back a unit, waking the longest waiting thread if there is one
+///
+/// Attempts to mirror sem_post()
+int green_sem_post(green_sem_t *);
+
+/// Initialize provided wait group with a count of zero
+void green_waitgroup_init(green_waitgroup_t *);
+
+/// Add to the count of outstanding tasks, typically before starting them
+///
+/// Waiters are woken once, when the count drops to zero
+void green_waitgroup_add(green_waitgroup_t *, int delta);
+
+/// Mark one outstanding task done
+void green_waitgroup_done(green_waitgroup_t *);
+
+/// Suspend the current thread until the count is zero
+void green_waitgroup_wait(green_waitgroup_t *);
+
+/// Initialize a channel of values elem_size bytes each, buffering up to capacity of them
+///
+/// An unbuffered channel (capacity 0) only passes a value once a sender meets a receiver
+/// Returns -1 if the buffer can't be allocated
+int green_chan_init(green_chan_t *, size_t elem_size, size_t capacity);
+
+/// Free the channel's buffer, nobody may use the channel anymore
+void green_chan_destroy(green_chan_t *);
+
+/// Send a value, suspending the thread while the channel has no room
+///
+/// A blocked receiver gets the value copied straight into it and runs next
+/// Returns -1 if the channel is closed
+int green_chan_send(green_chan_t *, const void *value);
+
+/// Receive a value, suspending the thread while the channel is empty
+///
+/// Returns -1 once the channel is closed and drained
+int green_chan_recv(green_chan_t *, void *value);
+
+/// Send an array of values in order, taking the channel's lock once for as many as fit
+///
+/// Returns how many were sent, fewer than count only if the channel was closed
+size_t green_chan_send_batch(green_chan_t *, const void *values, size_t count);
+
+/// Receive up to count values, suspending the thread only until the first one arrives
+///
+/// Returns how many were received, 0 once the channel is closed and drained
+size_t green_chan_recv_batch(green_chan_t *, void *values, size_t count);
+
+/// Close the channel, blocked and later senders fail, receivers fail once it's drained
+void green_chan_close(green_chan_t *);
+
+/// Complete whichever of several channel operations can go first
+///
+/// Like Go's select, cases that are ready are picked at random
+/// Suspends the thread until one is ready if block is set, returns -1 straight away otherwise
+/// Returns the index of the case that completed, its ok tells if the channel was closed
+/// Returns -1 if count is below 1, or with ENOMEM if a large select can't be set up
+int green_select(green_select_case_t *cases, int count, int block);
+
+/// Wait until a file descriptor is ready without blocking other threads
+///
+/// Attempts to mirror poll() on a single fd, events are POLLIN and/or POLLOUT
+/// Returns the events that happened, POLLERR and POLLHUP included, or -1 on error
+/// Any number of threads may wait on the same fd, an edge wakes every one waiting for its direction
+int green_wait_fd(int fd, int events);
+
+/// Read from an fd, parking the thread instead of blocking
+///
+/// Attempts to mirror read(), the fd is switched to non-blocking mode
+ssize_t green_read(int fd, void *buffer, size_t count);
+
+/// Write to an fd, parking the thread instead of blocking
+///
+/// Attempts to mirror write(), the fd is switched to non-blocking mode
+ssize_t green_write(int fd, const void *buffer, size_t count);
+
+/// Accept a connection, parking the thread instead of blocking
+///
+/// Attempts to mirror accept(), the listening fd is switched to non-blocking mode
+int green_accept(int fd, struct sockaddr *address, socklen_t *length);
+
+/// Connect a socket, parking the thread instead of blocking
+///
+/// Attempts to mirror connect(), the fd is switched to non-blocking mode
+int green_connect(int fd, const struct sockaddr *address, socklen_t length);
+
+/// Read from a file at an offset without blocking other threads
+///
+/// Attempts to mirror pread(), goes through io_uring when the kernel allows it,
+/// otherwise through a few helper threads
+ssize_t green_pread(int fd, void *buffer, size_t count, off_t offset);
+
+/// Write to a file at an offset without blocking other threads
+///
+/// Attempts to mirror pwrite(), see green_pread()
+ssize_t green_pwrite(int fd, const void *buffer, size_t count, off_t offset);
+
+/// Flush a file to storage without blocking other threads
+///
+/// Attempts to mirror fsync(), see green_pread()
+int green_fsync(int fd);
+
+typedef struct green_offload_stats_t {
+	unsigned long	calls;			// finished on a helper thread, offloaded calls and file I/O without io_uring
+	unsigned long	latency_ns;		// summed from being handed to a helper to finishing, queueing included
+	unsigned long	max_latency_ns;
+	unsigned		queued;			// waiting for a free helper right now
+	unsigned		max_queued;
+} green_offload_stats_t;
+
+/// Run a blocking call without blocking other threads
+///
+/// The call runs on a helper OS thread while the calling thread is parked,
+/// so it must not use green threads functionality itself
+void *green_offload(void *(*func)(void *), void *arg);
+
+/// Snapshot the helper thread statistics
+void green_offload_stats(green_offload_stats_t *stats);
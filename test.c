@@ -1,11 +1,31 @@
 #include "green.h"
 
+#include <assert.h>
+#include <errno.h>
 #include <stdio.h>
+#include <time.h>
 
 #define LOOP_COUNT		4
 #define VERBOSE_HUGGER	0
 #define SKIP_HUGGER		0
 #define COUNTER_SIZE	1000000
+#define ITEM_COUNT		10000
+#define PIPE_SIZE		1
+#define PIPE_CONSUMERS	4
+#define GATHER_COUNT	2000
+#define WORKERS			4
+#define CHAN_COUNT		5000	// values each channel sender sends
+#define CHAN_SIZE		16
+#define CHAN_BATCH		8
+#define RW_READERS		4
+#define RW_WRITERS		2
+#define RW_ROUNDS		1000	// times each rwlock thread takes the lock
+#define SEM_UNITS		3
+#define SEM_THREADS		8
+#define SEM_ROUNDS		1000	// units each semaphore thread takes
+#define TIMED_WAITERS	4
+#define TIMED_ATTEMPTS	200		// timed waits on the condition each waiter makes
+#define TIMED_WAIT_NS	200000
 
 int flag = 0;
 green_cond_t cond;
@@ -16,6 +36,25 @@ void *hugger(void *arg);
 void *producer(void *arg);
 void *consumer(void *arg);
 
+void *pipe_producer(void *arg);
+void *pipe_consumer(void *arg);
+
+void *gather(void *arg);
+void *gather_item(void *arg);
+
+void *chan_sender(void *arg);
+void *chan_batch_sender(void *arg);
+void *chan_selector(void *arg);
+void *chan_batch_receiver(void *arg);
+
+void *rw_reader(void *arg);
+void *rw_writer(void *arg);
+
+void *sem_user(void *arg);
+
+void *timed_waiter(void *arg);
+void *ringer(void *arg);
+
 typedef struct counter {
 	int parts[COUNTER_SIZE];	// large structure to increase chances of increment conflict
 } counter;
@@ -30,6 +69,67 @@ typedef struct thread_args {
 	green_cond_t *condition;	// Conditional variable that is used for synchronization
 } thread_args;
 
+/// Bounded buffer the pipe threads pass items through
+typedef struct pipe {
+	int items;		// in the buffer
+	int consumed;
+	int done;		// the producer has no more items
+	
+	green_mutex_t mutex;
+	green_cond_t not_empty;
+	green_cond_t not_full;
+} pipe;
+
+/// Channels the channel threads pass numbers through, and what came out of them
+typedef struct channels {
+	green_chan_t unbuffered;
+	green_chan_t buffered;
+	
+	long received;	// values
+	long sum;
+} channels;
+
+/// Reader-writer lock the rwlock threads share, and who they found inside with them
+typedef struct shared {
+	green_rwlock_t lock;
+	int readers;	// inside right now
+	int writers;
+	
+	long reads;
+	long writes;
+	int overlaps;	// times a writer was inside together with anyone else
+} shared;
+
+/// Units of a semaphore the semaphore threads take turns on, and a wait group for when they're done
+typedef struct units {
+	green_sem_t sem;
+	green_waitgroup_t running;
+	int holding;	// units taken right now
+	
+	long taken;
+	int overdrawn;	// times more threads held a unit than there are
+	int finished;	// threads
+} units;
+
+/// Condition the timed waiters wait on and the ringer signals, with how their waits ended
+typedef struct bell {
+	green_mutex_t mutex;
+	green_cond_t ring;
+	int done;	// the ringer can stop
+	
+	long wakeups;
+	long timeouts;
+	long locks;
+	long lock_timeouts;
+} bell;
+
+static void deadline_after(struct timespec *deadline, long ns) {
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_nsec += ns;
+	deadline->tv_sec += deadline->tv_nsec / 1000000000;
+	deadline->tv_nsec %= 1000000000;
+}
+
 static inline void increment_counter(counter *counter) {
 	for (int i = 0; i < COUNTER_SIZE; ++i) {
 		counter->parts[i]++;
@@ -140,6 +240,141 @@ int main() {
 	arguments[4].condition = &conditions[1];
 	
 	
+	// Runs before the hugger exists, so only the pipe threads switch
+	// Consumers blocked on the mutex are queued behind it instead of being woken to block again
+	static pipe items;
+	static green_t pipe_threads[PIPE_CONSUMERS + 1];
+	green_mutex_init(&items.mutex);
+	green_cond_init(&items.not_empty);
+	green_cond_init(&items.not_full);
+	
+	unsigned long switches = green_switch_count();
+	for (int i = 0; i < PIPE_CONSUMERS; ++i) {
+		green_create(&pipe_threads[i], &pipe_consumer, &items);
+	}
+	green_create(&pipe_threads[PIPE_CONSUMERS], &pipe_producer, &items);
+	
+	for (int i = 0; i <= PIPE_CONSUMERS; ++i) {
+		green_join(&pipe_threads[i], NULL);
+	}
+	switches = green_switch_count() - switches;
+	printf("Pipe moved %d items with %.2f switches per item\n", items.consumed, (double)switches / ITEM_COUNT);
+	
+	
+	// Joins from a green thread, whose stack is far smaller than main's
+	static green_t gatherer;
+	void *gathered;
+	green_create(&gatherer, &gather, NULL);
+	green_join(&gatherer, &gathered);
+	printf("Gather joined %ld results\n", (long)gathered);
+	
+	
+	// From here on threads run on several workers at once
+	green_set_concurrency(WORKERS);
+	
+	// A sender on each channel, selectors taking from both and a batch receiver on the buffered one
+	static channels numbers;
+	static green_t chan_threads[5];
+	green_chan_init(&numbers.unbuffered, sizeof(long), 0);
+	green_chan_init(&numbers.buffered, sizeof(long), CHAN_SIZE);
+	
+	green_create(&chan_threads[0], &chan_sender, &numbers);
+	green_create(&chan_threads[1], &chan_batch_sender, &numbers);
+	green_create(&chan_threads[2], &chan_selector, &numbers);
+	green_create(&chan_threads[3], &chan_selector, &numbers);
+	green_create(&chan_threads[4], &chan_batch_receiver, &numbers);
+	green_join(&chan_threads[0], NULL);
+	green_join(&chan_threads[1], NULL);
+	
+	// The receivers still drain what's buffered, then find both channels closed
+	green_chan_close(&numbers.unbuffered);
+	green_chan_close(&numbers.buffered);
+	long closed = 0;
+	assert(green_chan_send(&numbers.buffered, &closed) == -1);
+	
+	for (int i = 2; i < 5; ++i) {
+		green_join(&chan_threads[i], NULL);
+	}
+	assert(numbers.received == 2 * CHAN_COUNT);
+	assert(numbers.sum == (long)CHAN_COUNT * (CHAN_COUNT + 1));	// 1 to CHAN_COUNT twice
+	printf("Channels passed %ld values\n", numbers.received);
+	green_chan_destroy(&numbers.unbuffered);
+	green_chan_destroy(&numbers.buffered);
+	
+	
+	// Readers and writers take turns on one lock, once preferring readers and once writers
+	static shared data;
+	static green_t rw_threads[RW_READERS + RW_WRITERS];
+	for (int prefer_writers = 0; prefer_writers < 2; ++prefer_writers) {
+		green_rwlock_init(&data.lock);
+		green_rwlock_prefer_writers(&data.lock, prefer_writers);
+		
+		for (int i = 0; i < RW_READERS + RW_WRITERS; ++i) {
+			green_create(&rw_threads[i], (i < RW_READERS) ? &rw_reader : &rw_writer, &data);
+		}
+		for (int i = 0; i < RW_READERS + RW_WRITERS; ++i) {
+			green_join(&rw_threads[i], NULL);
+		}
+	}
+	assert(data.reads == 2 * RW_READERS * RW_ROUNDS);
+	assert(data.writes == 2 * RW_WRITERS * RW_ROUNDS);
+	assert(data.overlaps == 0);
+	printf("Rwlock let in %ld reads and %ld writes\n", data.reads, data.writes);
+	
+	
+	// Detached threads share a few semaphore units, the wait group stands in for joining them
+	static units pool;
+	green_sem_init(&pool.sem, SEM_UNITS);
+	green_waitgroup_init(&pool.running);
+	green_waitgroup_add(&pool.running, SEM_THREADS);
+	for (int i = 0; i < SEM_THREADS; ++i) {
+		green_create_detached(NULL, &sem_user, &pool);
+	}
+	green_waitgroup_wait(&pool.running);
+	
+	// Every unit has to be back
+	int left = 0;
+	while (green_sem_trywait(&pool.sem) == 0) left++;
+	assert(left == SEM_UNITS);
+	assert(pool.finished == SEM_THREADS);
+	assert(pool.taken == SEM_THREADS * SEM_ROUNDS);
+	assert(pool.overdrawn == 0);
+	printf("Semaphore handed out %ld units to %d threads\n", pool.taken, pool.finished);
+	
+	
+	// Waiters give up on the condition and the mutex whenever the ringer is too slow for them
+	static bell timed;
+	static green_t timed_threads[TIMED_WAITERS + 1];
+	green_mutex_init(&timed.mutex);
+	green_cond_init(&timed.ring);
+	for (int i = 0; i < TIMED_WAITERS; ++i) {
+		green_create(&timed_threads[i], &timed_waiter, &timed);
+	}
+	green_create(&timed_threads[TIMED_WAITERS], &ringer, &timed);
+	
+	// The first waiter takes a while, so joining it gives up a few times too
+	int join_timeouts = 0;
+	struct timespec deadline;
+	deadline_after(&deadline, TIMED_WAIT_NS);
+	while (green_join_timeout(&timed_threads[0], NULL, &deadline) == ETIMEDOUT) {
+		join_timeouts++;
+		deadline_after(&deadline, TIMED_WAIT_NS);
+	}
+	for (int i = 1; i < TIMED_WAITERS; ++i) {
+		green_join(&timed_threads[i], NULL);
+	}
+	
+	green_mutex_lock(&timed.mutex);
+	timed.done = 1;
+	green_mutex_unlock(&timed.mutex);
+	green_join(&timed_threads[TIMED_WAITERS], NULL);
+	
+	assert(timed.wakeups + timed.timeouts == TIMED_WAITERS * TIMED_ATTEMPTS);
+	assert(timed.locks == TIMED_WAITERS * TIMED_ATTEMPTS);
+	printf("Timed waits woke %ld times and timed out %ld times, locks timed out %ld times and the join %d times\n",
+		timed.wakeups, timed.timeouts, timed.lock_timeouts, join_timeouts);
+	
+	
 	green_create(&threads[0], &test, &arguments[0]);
 	green_create(&threads[1], &test, &arguments[1]);
 	green_create(&threads[2], &hugger, &arguments[2]);
@@ -147,11 +382,11 @@ int main() {
 	green_create(&threads[4], &producer, &arguments[4]);
 	
 	
-	green_join(&threads[0]);
-	green_join(&threads[1]);
+	green_join(&threads[0], NULL);
+	green_join(&threads[1], NULL);
 	// trying to join hugger is pointless as it's perpetual loop
-	green_join(&threads[3]);
-	green_join(&threads[4]);
+	green_join(&threads[3], NULL);
+	green_join(&threads[4], NULL);
 	
 	printf("done\n");
 	return 0;
@@ -278,3 +513,280 @@ void *producer(void *arg) {
 	
 	printf("Producer (%i) is done\n", id);
 }
+
+// Pipe producer fills the buffer, waiting whenever it's full
+void *pipe_producer(void *arg) {
+	pipe *items = (pipe *)arg;
+	
+	for (int i = 0; i < ITEM_COUNT; ++i) {
+		green_mutex_lock(&items->mutex);
+		while (items->items == PIPE_SIZE) {
+			green_cond_wait(&items->not_full, &items->mutex);
+		}
+		
+		items->items++;
+		green_cond_signal(&items->not_empty);
+		green_yield();	// stands in for being preempted while holding the mutex
+		green_mutex_unlock(&items->mutex);
+	}
+	
+	// Every consumer still waiting has to see there's nothing more coming
+	green_mutex_lock(&items->mutex);
+	items->done = 1;
+	green_cond_broadcast(&items->not_empty);
+	green_mutex_unlock(&items->mutex);
+	
+	return NULL;
+}
+
+// Pipe consumers take items until the producer is done and the buffer is empty
+void *pipe_consumer(void *arg) {
+	pipe *items = (pipe *)arg;
+	
+	green_mutex_lock(&items->mutex);
+	while (1) {
+		while (items->items == 0 && !items->done) {
+			green_cond_wait(&items->not_empty, &items->mutex);
+		}
+		
+		if (items->items == 0) break;
+		
+		items->items--;
+		items->consumed++;
+		green_cond_signal(&items->not_full);
+	}
+	green_mutex_unlock(&items->mutex);
+	
+	return NULL;
+}
+
+// Gather item hands its index back through join
+void *gather_item(void *arg) {
+	if ((long)arg % 3 == 0) green_yield();	// finish out of order
+	return arg;
+}
+
+// Gather scatters items over threads and collects them with green_join_all, then green_join_any
+//
+// Returns how many results came back right, 2 * GATHER_COUNT if all did
+void *gather(void *arg) {
+	(void)arg;
+	
+	static green_t items[GATHER_COUNT];
+	static green_t *pending[GATHER_COUNT];
+	static void *results[GATHER_COUNT];
+	long gathered = 0;
+	
+	for (long i = 0; i < GATHER_COUNT; ++i) {
+		green_create(&items[i], &gather_item, (void *)i);
+		pending[i] = &items[i];
+	}
+	
+	if (green_join_all(pending, GATHER_COUNT, results) == 0) {
+		for (long i = 0; i < GATHER_COUNT; ++i) {
+			if (results[i] == (void *)i) gathered++;
+		}
+	}
+	
+	for (long i = 0; i < GATHER_COUNT; ++i) {
+		green_create(&items[i], &gather_item, (void *)i);
+		pending[i] = &items[i];
+	}
+	
+	// Take whichever finished first out of the pending set until it's empty
+	for (int count = GATHER_COUNT; count > 0; --count) {
+		void *result;
+		int first = green_join_any(pending, count, &result);
+		if (first < 0) break;
+		
+		if (result == (void *)(pending[first] - items)) gathered++;
+		pending[first] = pending[count - 1];
+	}
+	
+	return (void *)gathered;
+}
+
+// Channel sender passes 1 to CHAN_COUNT through the unbuffered channel, one at a time
+void *chan_sender(void *arg) {
+	channels *numbers = (channels *)arg;
+	
+	for (long i = 1; i <= CHAN_COUNT; ++i) {
+		green_chan_send(&numbers->unbuffered, &i);
+	}
+	
+	return NULL;
+}
+
+// Channel batch sender passes 1 to CHAN_COUNT through the buffered channel, CHAN_BATCH at a time
+void *chan_batch_sender(void *arg) {
+	channels *numbers = (channels *)arg;
+	long batch[CHAN_BATCH];
+	
+	for (long i = 1; i <= CHAN_COUNT; i += CHAN_BATCH) {
+		size_t count = 0;
+		for (long value = i; value < i + CHAN_BATCH && value <= CHAN_COUNT; ++value) {
+			batch[count++] = value;
+		}
+		green_chan_send_batch(&numbers->buffered, batch, count);
+	}
+	
+	return NULL;
+}
+
+// Channel selector takes from whichever channel has a value until both are closed and drained
+void *chan_selector(void *arg) {
+	channels *numbers = (channels *)arg;
+	long values[2];
+	green_select_case_t cases[2] = {
+		{&numbers->unbuffered, 0, &values[0], 0},
+		{&numbers->buffered, 0, &values[1], 0},
+	};
+	long received = 0, sum = 0;
+	
+	// A closed channel fails its case from then on, so it's dropped from the select
+	int open = 2;
+	while (open > 0) {
+		int fired = green_select(cases, open, 1);
+		if (!cases[fired].ok) {
+			cases[fired] = cases[--open];
+			continue;
+		}
+		
+		received++;
+		sum += *(long *)cases[fired].value;
+	}
+	
+	__atomic_add_fetch(&numbers->received, received, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&numbers->sum, sum, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+// Channel batch receiver takes up to CHAN_BATCH values of the buffered channel at a time until it's drained
+void *chan_batch_receiver(void *arg) {
+	channels *numbers = (channels *)arg;
+	long batch[CHAN_BATCH];
+	long received = 0, sum = 0;
+	
+	size_t count;
+	while ((count = green_chan_recv_batch(&numbers->buffered, batch, CHAN_BATCH)) > 0) {
+		for (size_t i = 0; i < count; ++i) {
+			sum += batch[i];
+		}
+		received += count;
+	}
+	
+	__atomic_add_fetch(&numbers->received, received, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&numbers->sum, sum, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+// Rwlock reader holds the lock shared for a switch, checking no writer is in with it
+void *rw_reader(void *arg) {
+	shared *data = (shared *)arg;
+	
+	for (int i = 0; i < RW_ROUNDS; ++i) {
+		green_rwlock_rdlock(&data->lock);
+		__atomic_add_fetch(&data->readers, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&data->writers, __ATOMIC_SEQ_CST) != 0) {
+			__atomic_add_fetch(&data->overlaps, 1, __ATOMIC_RELAXED);
+		}
+		
+		green_yield();	// let the others try to get in meanwhile
+		
+		__atomic_add_fetch(&data->reads, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&data->readers, 1, __ATOMIC_SEQ_CST);
+		green_rwlock_unlock(&data->lock);
+	}
+	
+	return NULL;
+}
+
+// Rwlock writer holds the lock exclusively for a switch, checking nobody else is in with it
+void *rw_writer(void *arg) {
+	shared *data = (shared *)arg;
+	
+	for (int i = 0; i < RW_ROUNDS; ++i) {
+		green_rwlock_wrlock(&data->lock);
+		if (__atomic_add_fetch(&data->writers, 1, __ATOMIC_SEQ_CST) != 1
+			|| __atomic_load_n(&data->readers, __ATOMIC_SEQ_CST) != 0) {
+			__atomic_add_fetch(&data->overlaps, 1, __ATOMIC_RELAXED);
+		}
+		
+		green_yield();
+		
+		data->writes++;	// the lock guards this one
+		__atomic_sub_fetch(&data->writers, 1, __ATOMIC_SEQ_CST);
+		green_rwlock_unlock(&data->lock);
+	}
+	
+	return NULL;
+}
+
+// Semaphore user holds a unit for a switch at a time, then tells the wait group it's done
+void *sem_user(void *arg) {
+	units *pool = (units *)arg;
+	
+	for (int i = 0; i < SEM_ROUNDS; ++i) {
+		green_sem_wait(&pool->sem);
+		if (__atomic_add_fetch(&pool->holding, 1, __ATOMIC_SEQ_CST) > SEM_UNITS) {
+			__atomic_add_fetch(&pool->overdrawn, 1, __ATOMIC_RELAXED);
+		}
+		
+		green_yield();	// let the others try to take one meanwhile
+		
+		__atomic_add_fetch(&pool->taken, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&pool->holding, 1, __ATOMIC_SEQ_CST);
+		green_sem_post(&pool->sem);
+	}
+	
+	__atomic_add_fetch(&pool->finished, 1, __ATOMIC_RELAXED);
+	green_waitgroup_done(&pool->running);
+	return NULL;
+}
+
+// Timed waiter waits a while for the ringer each round, taking the mutex with a deadline as well
+void *timed_waiter(void *arg) {
+	bell *timed = (bell *)arg;
+	struct timespec deadline;
+	
+	for (int i = 0; i < TIMED_ATTEMPTS; ++i) {
+		deadline_after(&deadline, TIMED_WAIT_NS / 4);
+		while (green_mutex_timedlock(&timed->mutex, &deadline) == ETIMEDOUT) {
+			__atomic_add_fetch(&timed->lock_timeouts, 1, __ATOMIC_RELAXED);
+			deadline_after(&deadline, TIMED_WAIT_NS / 4);
+		}
+		timed->locks++;
+		
+		// The mutex is held again when this returns, however it went
+		deadline_after(&deadline, TIMED_WAIT_NS);
+		int result = green_cond_timedwait(&timed->ring, &timed->mutex, &deadline);
+		if (result == ETIMEDOUT) {
+			timed->timeouts++;
+		} else if (result == 0) {
+			timed->wakeups++;
+		}
+		green_mutex_unlock(&timed->mutex);
+		
+		green_sleep_ns(TIMED_WAIT_NS / 4);	// so the ringer is sometimes holding the mutex by the next round
+	}
+	
+	return NULL;
+}
+
+// Ringer signals one waiter every TIMED_WAIT_NS, holding the mutex for half of it
+void *ringer(void *arg) {
+	bell *timed = (bell *)arg;
+	
+	green_mutex_lock(&timed->mutex);
+	while (!timed->done) {
+		green_cond_signal(&timed->ring);
+		green_sleep_ns(TIMED_WAIT_NS / 2);
+		green_mutex_unlock(&timed->mutex);
+		
+		green_sleep_ns(TIMED_WAIT_NS / 2);
+		green_mutex_lock(&timed->mutex);
+	}
+	green_mutex_unlock(&timed->mutex);
+	
+	return NULL;
+}